@@ -13,6 +13,7 @@ LOCAL_SRC_FILES := \
     install.c \
     roots.c \
     ui.c \
+    ui_channel.c \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
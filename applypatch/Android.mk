@@ -13,13 +13,27 @@
 # limitations under the License.
 
 LOCAL_PATH := $(call my-dir)
+
+# BSDIFFZ1 (zstd) patches need external/zstd 1.4 or later, which isn't
+# in every tree.  Set ENABLE_ZSTD_PATCH := true to build them in;
+# otherwise only BSDIFF40 patches can be made or applied.
+applypatch_zstd_cflags :=
+applypatch_zstd_includes :=
+applypatch_zstd_libs :=
+ifeq ($(ENABLE_ZSTD_PATCH),true)
+  applypatch_zstd_cflags := -DUSE_ZSTD
+  applypatch_zstd_includes := external/zstd/lib
+  applypatch_zstd_libs := libzstd
+endif
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
-LOCAL_C_INCLUDES += external/bzip2 external/zlib $(LOCAL_PATH)/..
-LOCAL_STATIC_LIBRARIES += libmtdutils libmincrypt libbz libz
+LOCAL_CFLAGS += $(applypatch_zstd_cflags)
+LOCAL_C_INCLUDES += external/bzip2 external/zlib $(applypatch_zstd_includes) $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += libmtdutils libmincrypt libbz $(applypatch_zstd_libs) libz
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -28,7 +42,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := main.c
 LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
-LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz $(applypatch_zstd_libs) libminelf
 LOCAL_SHARED_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -40,7 +54,7 @@ LOCAL_MODULE := applypatch_static
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
-LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz $(applypatch_zstd_libs) libminelf
 LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -50,7 +64,32 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c
 LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
-LOCAL_C_INCLUDES += external/zlib external/bzip2
-LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_CFLAGS += $(applypatch_zstd_cflags)
+LOCAL_C_INCLUDES += external/zlib external/bzip2 $(applypatch_zstd_includes)
+LOCAL_STATIC_LIBRARIES += libz libbz $(applypatch_zstd_libs)
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bsdiff_benchmark.c benchmark_utils.c bsdiff.c
+LOCAL_MODULE := bsdiff_benchmark
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += $(applypatch_zstd_cflags)
+LOCAL_C_INCLUDES += external/bzip2 $(applypatch_zstd_includes)
+LOCAL_STATIC_LIBRARIES += libbz $(applypatch_zstd_libs)
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bspatch_benchmark.c benchmark_utils.c bsdiff.c bspatch.c
+LOCAL_MODULE := bspatch_benchmark
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += $(applypatch_zstd_cflags)
+LOCAL_C_INCLUDES += external/bzip2 $(applypatch_zstd_includes) $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz $(applypatch_zstd_libs)
+LOCAL_LDLIBS += -lpthread
 
 include $(BUILD_HOST_EXECUTABLE)
@@ -19,10 +19,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
@@ -53,6 +56,7 @@ static int mtd_partitions_scanned = 0;
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
@@ -105,6 +109,121 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+// Like LoadFileContents(), but map a regular file rather than read it
+// into the heap, so that memory use doesn't depend on the file's size.
+// Masking retouched entries only copies the pages it changes.  Free
+// the result with FreeFileContents().
+//
+// Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return (errno == ENOENT ? -ENOENT : -1);
+    }
+    if (fstat(fd, &file->st) != 0 || !S_ISREG(file->st.st_mode) ||
+        file->st.st_size == 0) {
+        close(fd);
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+
+    file->size = file->st.st_size;
+    void* data = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to map \"%s\": %s; reading it instead\n",
+               filename, strerror(errno));
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+    file->data = data;
+    file->mapped = 1;
+
+    if (retouch_flag) {
+        int32_t desired_offset = 0;
+        if (retouch_mask_data(file->data, file->size,
+                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+            printf("error trying to mask retouch entries\n");
+            FreeFileContents(file);
+            return -1;
+        }
+    }
+
+    SHA_hash(file->data, file->size, file->sha1);
+    return 0;
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
+#define SHA1_FILE_CHUNK (256 * 1024)
+
+// Compute the SHA-1 of a file by reading it a chunk at a time, so
+// that large files and whole block devices can be checked in constant
+// memory.  Unlike LoadFileContents(), this takes only real paths (no
+// "MTD:" or "EMMC:" specs) and doesn't mask retouched binaries; it
+// uses no global state and may be called from several threads.
+//
+// Return 0 on success.
+int Sha1File(const char* filename, uint8_t digest[SHA_DIGEST_SIZE]) {
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        printf("can't hash partition spec \"%s\" in place; "
+               "load it with LoadFileContents() instead\n", filename);
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return (errno == ENOENT ? -ENOENT : -1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned char* buffer = malloc(SHA1_FILE_CHUNK);
+    if (buffer == NULL) {
+        printf("failed to allocate read buffer\n");
+        close(fd);
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int result = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, SHA1_FILE_CHUNK)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("failed to read \"%s\": %s\n", filename, strerror(errno));
+            result = -1;
+            break;
+        }
+        SHA_update(&ctx, buffer, n);
+    }
+    const uint8_t* sha = SHA_final(&ctx);
+    if (result == 0) memcpy(digest, sha, SHA_DIGEST_SIZE);
+
+    free(buffer);
+    close(fd);
+    return result;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -355,6 +474,78 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+#define VERIFY_CHUNK (1 << 20)
+#define VERIFY_ALIGN 4096
+
+// Read back the first len bytes of the EMMC partition just written
+// through fd and compare them with data.  Returns len if they match,
+// the offset of the first chunk that doesn't, or -1 on error.
+//
+// Only this device's cached pages are dropped (BLKFLSBUF, or
+// fadvise() for a plain file), and the read-back uses O_DIRECT where
+// the device allows it, so the rest of the page cache is left alone.
+static ssize_t VerifyPartition(int fd, const char* partition,
+                               const unsigned char* data, size_t len) {
+    if (ioctl(fd, BLKFLSBUF) != 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    int direct = 1;
+    int vfd = open(partition, O_RDONLY | O_DIRECT);
+    if (vfd < 0) {
+        direct = 0;
+        vfd = open(partition, O_RDONLY);
+    }
+    if (vfd < 0) {
+        printf("failed to open %s for verification: %s\n",
+               partition, strerror(errno));
+        return -1;
+    }
+
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, VERIFY_ALIGN, VERIFY_CHUNK) != 0) {
+        printf("failed to allocate verification buffer\n");
+        close(vfd);
+        return -1;
+    }
+
+    ssize_t result = len;
+    size_t p;
+    for (p = 0; p < len; p += VERIFY_CHUNK) {
+        size_t to_read = len - p;
+        if (to_read > VERIFY_CHUNK) to_read = VERIFY_CHUNK;
+        // O_DIRECT reads are of whole, aligned blocks.
+        size_t want = direct ?
+            (to_read + VERIFY_ALIGN - 1) & ~(VERIFY_ALIGN - 1) : to_read;
+
+        size_t so_far = 0;
+        while (so_far < to_read) {
+            ssize_t read_count = pread(vfd, (char*)buffer + so_far,
+                                       want - so_far, p + so_far);
+            if (read_count < 0 && errno == EINTR) continue;
+            if (read_count <= 0) {
+                printf("verify read error %s at %ld: %s\n", partition,
+                       (long)(p + so_far),
+                       read_count < 0 ? strerror(errno) : "end of device");
+                result = -1;
+                goto done;
+            }
+            so_far += read_count;
+        }
+
+        if (memcmp(buffer, data + p, to_read) != 0) {
+            printf("verification failed starting at %ld\n", (long)p);
+            result = p;
+            goto done;
+        }
+    }
+
+  done:
+    free(buffer);
+    close(vfd);
+    return result;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -451,49 +642,11 @@ int WriteToPartition(unsigned char* data, size_t len,
                 }
                 fsync(fd);
 
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
+                ssize_t verified = VerifyPartition(fd, partition, data, len);
+                if (verified < 0) {
+                    return -1;
                 }
+                start = verified;
 
                 if (start == len) {
                     printf("verification read succeeded (attempt %d)\n", attempt+1);
@@ -574,12 +727,13 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = MapFileContents(filename, &file, RETOUCH_DO_MASK);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -590,8 +744,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -599,19 +752,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -722,19 +875,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.mapped = 0;
     source_file.data = NULL;
+    source_file.mapped = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
+    if (MapFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -744,9 +899,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
                          RETOUCH_DO_MASK);
     }
 
@@ -754,16 +908,16 @@ int applypatch(const char* source_filename,
         int to_use = FindMatchingPatch(source_file.sha1,
                                        patch_sha1_str, num_patches);
         if (to_use >= 0) {
+            LoadValue(patch_data[to_use]);
             source_patch_value = patch_data[to_use];
         }
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
                              RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
@@ -773,13 +927,14 @@ int applypatch(const char* source_filename,
         int to_use = FindMatchingPatch(copy_file.sha1,
                                        patch_sha1_str, num_patches);
         if (to_use >= 0) {
+            LoadValue(patch_data[to_use]);
             copy_patch_value = patch_data[to_use];
         }
 
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -788,8 +943,8 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
@@ -888,7 +1043,25 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
                 made_copy = 1;
+
+                // The blocks of a mapped file stay allocated until it's
+                // unmapped, so let go of the source before deleting it,
+                // and patch from the copy on /cache instead.  (The copy
+                // is already masked, so don't mask it again.)
+                uint8_t source_sha1[SHA_DIGEST_SIZE];
+                struct stat source_st = source_file->st;
+                memcpy(source_sha1, source_file->sha1, SHA_DIGEST_SIZE);
+                FreeFileContents(source_file);
                 unlink(source_filename);
+                if (MapFileContents(CACHE_TEMP_SOURCE, source_file,
+                                    RETOUCH_DONT_MASK) != 0 ||
+                    memcmp(source_file->sha1, source_sha1,
+                           SHA_DIGEST_SIZE) != 0) {
+                    printf("failed to reload source from %s\n",
+                           CACHE_TEMP_SOURCE);
+                    return 1;
+                }
+                source_file->st = source_st;
 
                 size_t free_space = FreeSpaceForFile(target_fs);
                 printf("(now %ld bytes free for target)\n", (long)free_space);
@@ -949,8 +1122,7 @@ static int GenerateTarget(FileContents* source_file,
 
         int result;
 
-        if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+        if (header_bytes_read >= 8 && IsBSDiffPatch(header)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
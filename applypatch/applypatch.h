@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;  // data is mmap()ed; see MapFileContents()
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -63,13 +64,19 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
+int Sha1File(const char* filename, uint8_t digest[SHA_DIGEST_SIZE]);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches);
 
 // bsdiff.c
 void ShowBSDiffLicense();
+// True if the 8 bytes at header are the magic number of a patch
+// ApplyBSDiffPatch() understands: BSDIFF40 (bzip2) or BSDIFFZ1 (zstd).
+int IsBSDiffPatch(const void* header);
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
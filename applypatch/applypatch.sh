@@ -253,10 +253,21 @@ free_kb=$(free_space $WORK_FS)
 echo "${free_kb}kb free on /$WORK_FS now."
 
 testname "apply bsdiff patch with low space"
-run_command $WORK_DIR/applypatch $WORK_DIR/old.file - $NEW_SHA1 $NEW_SIZE $BAD1_SHA1:$WORK_DIR/foo $OLD_SHA1:$WORK_DIR/patch.bsdiff || fail
+run_command $WORK_DIR/applypatch $WORK_DIR/old.file - $NEW_SHA1 $NEW_SIZE $BAD1_SHA1:$WORK_DIR/foo $OLD_SHA1:$WORK_DIR/patch.bsdiff > $tmpdir/lowspace.log || fail
+cat $tmpdir/lowspace.log
 $ADB pull $WORK_DIR/old.file $tmpdir/patched
 diff -q $DATA_DIR/new.file $tmpdir/patched || fail
 
+# Deleting the source must actually free its blocks (it mustn't still
+# be mapped or open), so the space reported afterwards has to grow by
+# about the size of old.file.
+testname "deleting source with low space frees its blocks"
+before=$(sed -n 's/.*free space \([0-9]*\) bytes.*/\1/p' $tmpdir/lowspace.log | head -1)
+after=$(sed -n 's/^(now \([0-9]*\) bytes free.*/\1/p' $tmpdir/lowspace.log | head -1)
+echo "free before $before, after $after"
+[ -n "$before" ] && [ -n "$after" ] || fail
+[ $((after - before)) -ge $(( $(stat -c %s $DATA_DIR/old.file) / 2 )) ] || fail
+
 testname "reapply bsdiff patch with low space"
 run_command $WORK_DIR/applypatch $WORK_DIR/old.file - $NEW_SHA1 $NEW_SIZE $BAD1_SHA1:$WORK_DIR/foo $OLD_SHA1:$WORK_DIR/patch.bsdiff || fail
 $ADB pull $WORK_DIR/old.file $tmpdir/patched
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "benchmark_utils.h"
+
+double BenchmarkNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned char* BenchmarkReadFile(const char* filename, off_t* size) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    printf("failed to stat \"%s\"\n", filename);
+    return NULL;
+  }
+  unsigned char* data = malloc(st.st_size + 1);
+  FILE* f = fopen(filename, "rb");
+  if (data == NULL || f == NULL ||
+      fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+    printf("failed to read \"%s\"\n", filename);
+    if (f != NULL) fclose(f);
+    free(data);
+    return NULL;
+  }
+  fclose(f);
+  *size = st.st_size;
+  return data;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_BENCHMARK_UTILS_H
+#define _BUILD_TOOLS_APPLYPATCH_BENCHMARK_UTILS_H
+
+#include <sys/types.h>
+
+// Helpers shared by the host benchmarks.
+
+// Seconds on the monotonic clock.
+double BenchmarkNow();
+
+// Read a whole file into a malloc'd buffer (with one spare byte at the
+// end) and store its length in *size.  Prints a message and returns
+// NULL on failure.
+unsigned char* BenchmarkReadFile(const char* filename, off_t* size);
+
+#endif //  _BUILD_TOOLS_APPLYPATCH_BENCHMARK_UTILS_H
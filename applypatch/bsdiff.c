@@ -50,10 +50,19 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#if ZSTD_VERSION_NUMBER < 10400
+#error "BSDIFFZ1 support needs zstd 1.4.0 or later"
+#endif
+#endif
+
+#include "bsdiff.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -156,6 +165,184 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/*
+ * SA-IS suffix sorting, from Nong, Zhang and Chan, "Two Efficient
+ * Algorithms for Linear Suffix Array Construction" (2009).  It runs in
+ * linear time and needs the 32-bit suffix array plus a bit per
+ * character, against qsufsort's two off_t arrays.
+ *
+ * At the top level s is the old data with each byte shifted up by one
+ * and a virtual 0 appended (n is oldsize+1), so the empty suffix sorts
+ * first and the result is exactly what qsufsort produces.  Reduced
+ * strings at deeper levels are int32_t.
+ */
+static const u_char sais_mask[]={0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01};
+
+#define tget(i) ((t[(i)/8]&sais_mask[(i)%8]) ? 1 : 0)
+#define tset(i,b) t[(i)/8]=(b) ? (sais_mask[(i)%8]|t[(i)/8]) : \
+		((~sais_mask[(i)%8])&t[(i)/8])
+#define chr(i) (cs==sizeof(int32_t) ? ((const int32_t *)s)[i] : \
+		((i)==n-1 ? 0 : ((const u_char *)s)[i]+1))
+#define isLMS(i) ((i)>0 && tget(i) && !tget((i)-1))
+
+static void sais_buckets(const void *s,int32_t *bkt,int32_t n,int32_t K,
+		int cs,int end)
+{
+	int32_t i,sum=0;
+
+	for(i=0;i<=K;i++) bkt[i]=0;
+	for(i=0;i<n;i++) bkt[chr(i)]++;
+	for(i=0;i<=K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
+
+static void sais_induce(const u_char *t,int32_t *SA,const void *s,
+		int32_t *bkt,int32_t n,int32_t K,int cs)
+{
+	int32_t i,j;
+
+	/* L-type suffixes, left to right from the bucket heads */
+	sais_buckets(s,bkt,n,K,cs,0);
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0 && !tget(j)) SA[bkt[chr(j)]++]=j;
+	};
+
+	/* S-type suffixes, right to left from the bucket tails */
+	sais_buckets(s,bkt,n,K,cs,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0 && tget(j)) SA[--bkt[chr(j)]]=j;
+	};
+}
+
+static int sais(const void *s,int32_t *SA,int32_t n,int32_t K,int cs)
+{
+	u_char *t;
+	int32_t *bkt,*s1;
+	int32_t i,j,d,n1,name,pos,prev;
+	int diff;
+
+	/* Classify each character as S-type (1) or L-type (0) */
+	if((t=calloc(1,n/8+1))==NULL) return -1;
+	tset(n-2,0);
+	tset(n-1,1);
+	for(i=n-3;i>=0;i--)
+		tset(i,(chr(i)<chr(i+1) ||
+			(chr(i)==chr(i+1) && tget(i+1))) ? 1 : 0);
+
+	/* Stage 1: sort the LMS substrings */
+	if((bkt=malloc((K+1)*sizeof(int32_t)))==NULL) {
+		free(t);
+		return -1;
+	};
+	sais_buckets(s,bkt,n,K,cs,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(isLMS(i)) SA[--bkt[chr(i)]]=i;
+	sais_induce(t,SA,s,bkt,n,K,cs);
+	free(bkt);
+
+	/* Move the sorted LMS substrings to the front and name them */
+	n1=0;
+	for(i=0;i<n;i++) if(isLMS(SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;d<n;d++) {
+			if(prev==-1 || chr(pos+d)!=chr(prev+d) ||
+					tget(pos+d)!=tget(prev+d)) {
+				diff=1;
+				break;
+			};
+			if(d>0 && (isLMS(pos+d) || isLMS(prev+d))) break;
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* Stage 2: sort the reduced string, recursing if names repeat */
+	s1=SA+n-n1;
+	if(name<n1) {
+		if(sais(s1,SA,n1,name-1,sizeof(int32_t))) {
+			free(t);
+			return -1;
+		};
+	} else {
+		for(i=0;i<n1;i++) SA[s1[i]]=i;
+	};
+
+	/* Stage 3: induce the full order from the sorted LMS suffixes */
+	if((bkt=malloc((K+1)*sizeof(int32_t)))==NULL) {
+		free(t);
+		return -1;
+	};
+	sais_buckets(s,bkt,n,K,cs,1);
+	for(i=1,j=0;i<n;i++) if(isLMS(i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA[i]=s1[SA[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=-1;
+		SA[--bkt[chr(j)]]=j;
+	};
+	sais_induce(t,SA,s,bkt,n,K,cs);
+
+	free(bkt);
+	free(t);
+	return 0;
+}
+
+#undef tget
+#undef tset
+#undef chr
+#undef isLMS
+
+SuffixArray* BuildSuffixArray(const u_char *old,off_t oldsize,int method)
+{
+	SuffixArray *sa;
+	off_t *V;
+
+	if(method==SUFFIX_SORT_DEFAULT)
+		method=(oldsize<INT32_MAX) ? SUFFIX_SORT_SAIS :
+			SUFFIX_SORT_QSUFSORT;
+
+	if((sa=calloc(1,sizeof(SuffixArray)))==NULL) return NULL;
+	sa->n=oldsize+1;
+
+	if(method==SUFFIX_SORT_SAIS) {
+		if(oldsize>=INT32_MAX) goto fail;
+		if((sa->I32=malloc(sa->n*sizeof(int32_t)))==NULL) goto fail;
+		if(oldsize==0) {
+			sa->I32[0]=0;
+		} else if(sais(old,sa->I32,sa->n,256,1)) {
+			goto fail;
+		};
+	} else {
+		if((sa->I=malloc(sa->n*sizeof(off_t)))==NULL) goto fail;
+		if((V=malloc(sa->n*sizeof(off_t)))==NULL) goto fail;
+		qsufsort(sa->I,V,(u_char *)old,oldsize);
+		free(V);
+	};
+	return sa;
+
+fail:
+	FreeSuffixArray(sa);
+	return NULL;
+}
+
+void FreeSuffixArray(SuffixArray *sa)
+{
+	if(sa==NULL) return;
+	free(sa->I32);
+	free(sa->I);
+	free(sa);
+}
+
+#define SA_AT(sa,i) ((sa)->I32 ? (off_t)(sa)->I32[i] : (sa)->I[i])
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,29 +353,32 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const SuffixArray *sa,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=SA_AT(sa,st);
+		ien=SA_AT(sa,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	ix=SA_AT(sa,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
+		return search(sa,old,oldsize,new,newsize,x,en,pos);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search(sa,old,oldsize,new,newsize,st,x,pos);
 	};
 }
 
@@ -210,22 +400,100 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+/* Growable buffer holding the patch as it's built */
+typedef struct {
+	u_char *data;
+	off_t len;
+	off_t size;
+} PatchBuffer;
+
+static void reserve(PatchBuffer *pb,off_t more)
+{
+	if(pb->len+more<=pb->size) return;
+	pb->size=pb->size*2>pb->len+more ? pb->size*2 : pb->len+more;
+	if((pb->data=realloc(pb->data,pb->size))==NULL) err(1,NULL);
+}
+
+/* Append data[0, len) to pb as one complete bzip2 stream */
+static void bz2_append(PatchBuffer *pb,u_char *data,off_t len)
+{
+	bz_stream strm;
+	int action,ret;
+
+	memset(&strm,0,sizeof(strm));
+	if((ret=BZ2_bzCompressInit(&strm,9,0,0))!=BZ_OK)
+		errx(1, "BZ2_bzCompressInit, bz2err = %d", ret);
+	do {
+		/* avail_in is only 32 bits wide */
+		if(strm.avail_in==0 && len>0) {
+			strm.next_in=(char *)data;
+			strm.avail_in=MIN(len,1<<30);
+			data+=strm.avail_in;
+			len-=strm.avail_in;
+		};
+		action=(len==0) ? BZ_FINISH : BZ_RUN;
+		reserve(pb,65536);
+		strm.next_out=(char *)(pb->data+pb->len);
+		strm.avail_out=pb->size-pb->len;
+		ret=BZ2_bzCompress(&strm,action);
+		pb->len=(u_char *)strm.next_out-pb->data;
+		if(ret<0)
+			errx(1, "BZ2_bzCompress, bz2err = %d", ret);
+	} while(ret!=BZ_STREAM_END);
+	BZ2_bzCompressEnd(&strm);
+}
+
+#ifdef USE_ZSTD
+/*
+ * zstd settings for BSDIFFZ1 blocks.  The window is capped at
+ * BSDIFFZ1_WINDOW_LOG whatever the size of the file.
+ */
+#define ZSTD_LEVEL 19
+
+/* Append data[0, len) to pb as one zstd frame */
+static void zstd_append(PatchBuffer *pb,u_char *data,off_t len)
+{
+	ZSTD_CCtx *cctx;
+	size_t ret;
+
+	if((cctx=ZSTD_createCCtx())==NULL) err(1,NULL);
+	ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,ZSTD_LEVEL);
+	ZSTD_CCtx_setParameter(cctx,ZSTD_c_windowLog,BSDIFFZ1_WINDOW_LOG);
+	reserve(pb,ZSTD_compressBound(len));
+	ret=ZSTD_compress2(cctx,pb->data+pb->len,pb->size-pb->len,data,len);
+	if(ZSTD_isError(ret))
+		errx(1, "ZSTD_compress2: %s", ZSTD_getErrorName(ret));
+	pb->len+=ret;
+	ZSTD_freeCCtx(cctx);
+}
+#endif
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//    - the suffix array is owned by the caller, who passes a pointer
+//      to *SAP, which can be NULL.  This way if we call bsdiff()
+//      multiple times with the same 'old' data, we only do the
+//      sorting step the first time.
+//
+//    - suffixes are sorted with SA-IS into 32-bit entries when 'old'
+//      is small enough, rather than always with qsufsort().  The
+//      order is the same either way, and so is the patch.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+//    - the patch is built in memory; bsdiff() writes it out to a
+//      file afterwards.
+//
+//    - the blocks can be compressed with zstd instead of bzip2, which
+//      gives a BSDIFFZ1 patch.
+//
+int bsdiff_mem(u_char* old, off_t oldsize, SuffixArray** SAP,
+               u_char* new, off_t newsize, int format,
+               u_char** patch, off_t* patch_len)
 {
-	int fd;
-	off_t *I;
+	SuffixArray *sa;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -234,57 +502,35 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	off_t i;
 	off_t dblen,eblen;
 	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+	PatchBuffer ctrl,out;
+	void (*compress)(PatchBuffer *,u_char *,off_t);
+
+#ifndef USE_ZSTD
+	if(format==BSDIFF_FORMAT_ZSTD)
+		errx(1,"BSDIFFZ1 patches need a build with USE_ZSTD");
+#endif
+
+        if (*SAP == NULL) {
+            *SAP = BuildSuffixArray(old, oldsize, SUFFIX_SORT_DEFAULT);
+            if (*SAP == NULL) err(1, NULL);
         }
-        I = *IP;
+        sa = *SAP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
 	dblen=0;
 	eblen=0;
+	memset(&ctrl,0,sizeof(ctrl));
+	memset(&out,0,sizeof(out));
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
+	/* Compute the differences, collecting ctrl as we go */
+	scan=0;len=0;pos=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
+			len=search(sa,old,oldsize,new+scan,newsize-scan,
 					0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
@@ -340,71 +586,78 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			reserve(&ctrl,24);
+			offtout(lenf,ctrl.data+ctrl.len);
+			offtout((scan-lenb)-(lastscan+lenf),ctrl.data+ctrl.len+8);
+			offtout((pos-lenb)-(lastpos+lenf),ctrl.data+ctrl.len+16);
+			ctrl.len+=24;
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-	if (fclose(pf))
-		err(1, "fclose");
+
+	/* Header is
+		0	8	 "BSDIFF40"
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block */
+	/* A BSDIFFZ1 patch is the same, with zstd frames for blocks */
+	reserve(&out,32);
+#ifdef USE_ZSTD
+	if(format==BSDIFF_FORMAT_ZSTD) {
+		memcpy(out.data,"BSDIFFZ1",8);
+		compress=zstd_append;
+	} else
+#endif
+	{
+		memcpy(out.data,"BSDIFF40",8);
+		compress=bz2_append;
+	};
+	offtout(newsize,out.data+24);
+	out.len=32;
+
+	compress(&out,ctrl.data,ctrl.len);
+	offtout(out.len-32,out.data+8);
+	len=out.len;
+	compress(&out,db,dblen);
+	offtout(out.len-len,out.data+16);
+	compress(&out,eb,eblen);
 
 	/* Free the memory we used */
+	free(ctrl.data);
 	free(db);
 	free(eb);
 
+	*patch=out.data;
+	*patch_len=out.len;
+	return 0;
+}
+
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP,
+           u_char* new, off_t newsize, const char* patch_filename)
+{
+	u_char *patch;
+	off_t patch_len;
+	FILE * pf;
+
+	if(bsdiff_mem(old,oldsize,SAP,new,newsize,BSDIFF_FORMAT_BZIP2,
+			&patch,&patch_len)!=0)
+		return 1;
+
+	if ((pf = fopen(patch_filename, "w")) == NULL)
+              err(1, "%s", patch_filename);
+	if (fwrite(patch, 1, patch_len, pf) != (size_t)patch_len)
+		err(1, "fwrite(%s)", patch_filename);
+	if (fclose(pf))
+		err(1, "fclose");
+
+	free(patch);
 	return 0;
 }
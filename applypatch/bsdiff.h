@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_BSDIFF_H
+#define _APPLYPATCH_BSDIFF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Sorted suffixes of bsdiff()'s 'old' data.  Entries are 32 bits
+// wide when the data is small enough, and off_t otherwise.
+typedef struct {
+    off_t n;            // oldsize+1 entries; entry 0 is always oldsize
+    int32_t* I32;
+    off_t* I;
+} SuffixArray;
+
+// Which algorithm BuildSuffixArray() uses.
+#define SUFFIX_SORT_DEFAULT   0   // SA-IS if it fits in 32 bits
+#define SUFFIX_SORT_QSUFSORT  1   // Larsson-Sadakane, off_t entries
+#define SUFFIX_SORT_SAIS      2   // SA-IS, 32-bit entries only
+
+// Sort the suffixes of old[0, oldsize).  Every method produces the
+// same order.  Returns NULL if allocation fails or the method can't
+// handle data this large.
+SuffixArray* BuildSuffixArray(const u_char* old, off_t oldsize, int method);
+void FreeSuffixArray(SuffixArray* sa);
+
+// Write a BSDIFF40 patch turning old into new to patch_filename.  *SAP
+// caches the suffix array of old across calls: if it's NULL it is
+// built and stored there, and the caller frees it with
+// FreeSuffixArray().
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP,
+           u_char* new, off_t newsize, const char* patch_filename);
+
+// Patch formats bsdiff_mem() can write.  They differ only in how the
+// control, diff and extra blocks are compressed.
+#define BSDIFF_FORMAT_BZIP2   0   // "BSDIFF40"
+#define BSDIFF_FORMAT_ZSTD    1   // "BSDIFFZ1", several times faster to apply;
+                                  // only in builds with USE_ZSTD
+
+// log2 of the zstd window of BSDIFFZ1 blocks.  bsdiff_mem() never uses
+// a larger one and ApplyBSDiffPatch() rejects frames that ask for more,
+// so each decoding stream needs at most 4 MB of history.
+#define BSDIFFZ1_WINDOW_LOG   22
+
+// Like bsdiff(), but return the patch in a malloc'd buffer in *patch
+// and its length in *patch_len instead of writing a file, in the
+// given format.  Calls on different threads are safe as long as *SAP
+// is already built.
+int bsdiff_mem(u_char* old, off_t oldsize, SuffixArray** SAP,
+               u_char* new, off_t newsize, int format,
+               u_char** patch, off_t* patch_len);
+
+#endif
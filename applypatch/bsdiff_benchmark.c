@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compare the suffix sorters bsdiff() can use: time and peak memory
+// of each, and whether they agree.
+//
+//   bsdiff_benchmark <file> [<file> ...]
+//   bsdiff_benchmark -s <megabytes>     (synthetic data)
+//
+// Each sort runs in a child process so that its peak RSS can be
+// measured on its own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchmark_utils.h"
+#include "bsdiff.h"
+
+static long max_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+// Something like an executable image: runs of repeated records with
+// a few bytes changing, mixed with stretches of noise.
+static unsigned char* synthesize(off_t size) {
+  unsigned char* data = malloc(size + 1);
+  unsigned char record[256];
+  off_t i = 0;
+  srand(1);
+  while (i < size) {
+    int len = 16 + rand() % 240;
+    int j;
+    if (rand() % 4 == 0) {
+      for (j = 0; j < len && i < size; ++j) data[i++] = rand();
+      continue;
+    }
+    for (j = 0; j < len; ++j) record[j] = rand() % 16;
+    int copies = 1 + rand() % 32;
+    while (copies-- > 0) {
+      record[rand() % len] = rand();
+      for (j = 0; j < len && i < size; ++j) data[i++] = record[j];
+    }
+  }
+  return data;
+}
+
+static const char* method_name(int method) {
+  return method == SUFFIX_SORT_SAIS ? "sa-is" : "qsufsort";
+}
+
+// Sort in a child process; print its time and peak RSS above the
+// baseline (the data itself).
+static int time_sort(const unsigned char* data, off_t size, int method) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    long base = max_rss_kb();
+    double start = BenchmarkNow();
+    SuffixArray* sa = BuildSuffixArray(data, size, method);
+    double elapsed = BenchmarkNow() - start;
+    if (sa == NULL) {
+      printf("  %-9s failed\n", method_name(method));
+      fflush(stdout);
+      _exit(1);
+    }
+    printf("  %-9s %9.3f s %10ld KB\n", method_name(method), elapsed,
+           max_rss_kb() - base);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int same_order(const unsigned char* data, off_t size) {
+  SuffixArray* a = BuildSuffixArray(data, size, SUFFIX_SORT_QSUFSORT);
+  SuffixArray* b = BuildSuffixArray(data, size, SUFFIX_SORT_SAIS);
+  int same = a != NULL && b != NULL;
+  off_t i;
+  for (i = 0; same && i <= size; ++i) {
+    same = a->I[i] == b->I32[i];
+  }
+  FreeSuffixArray(a);
+  FreeSuffixArray(b);
+  return same;
+}
+
+static int run(const char* name, unsigned char* data, off_t size) {
+  printf("%s: %lld bytes\n", name, (long long)size);
+  // Touch every page of the data before the children inherit it, so
+  // it counts towards the baseline rather than the sort.
+  volatile unsigned char sum = 0;
+  off_t i;
+  for (i = 0; i < size; i += 4096) sum += data[i];
+
+  int result = 0;
+  if (time_sort(data, size, SUFFIX_SORT_QSUFSORT) != 0) result = -1;
+  if (time_sort(data, size, SUFFIX_SORT_SAIS) != 0) result = -1;
+  if (result == 0) {
+    if (same_order(data, size)) {
+      printf("  suffix arrays match\n");
+    } else {
+      printf("  SUFFIX ARRAYS DIFFER\n");
+      result = -1;
+    }
+  }
+  return result;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s <file> [<file> ...]\n"
+                  "       %s -s <megabytes>\n", prog, prog);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  int result = 0;
+  if (strcmp(argv[1], "-s") == 0) {
+    if (argc != 3) {
+      usage(argv[0]);
+      return 2;
+    }
+    off_t size = (off_t)atoi(argv[2]) << 20;
+    unsigned char* data = synthesize(size);
+    result = run("synthetic", data, size);
+    free(data);
+  } else {
+    int i;
+    for (i = 1; i < argc; ++i) {
+      off_t size;
+      unsigned char* data = BenchmarkReadFile(argv[i], &size);
+      if (data == NULL || run(argv[i], data, size) != 0) result = -1;
+      free(data);
+    }
+  }
+  return result == 0 ? 0 : 1;
+}
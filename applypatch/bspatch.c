@@ -20,16 +20,25 @@
 // applypatch with the -l option will display the bsdiff license
 // notice.
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#if ZSTD_VERSION_NUMBER < 10400
+#error "BSDIFFZ1 support needs zstd 1.4.0 or later"
+#endif
+#endif
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -61,6 +70,17 @@ void ShowBSDiffLicense() {
          "This program uses Julian R Seward's \"libbzip2\" library, available\n"
          "from http://www.bzip.org/.\n"
         );
+#ifdef USE_ZSTD
+    puts("------------------\n\n"
+         "It also uses the Zstandard library, Copyright (c) Meta Platforms,\n"
+         "Inc. and affiliates, available from https://github.com/facebook/zstd.\n"
+        );
+#endif
+}
+
+int IsBSDiffPatch(const void* header) {
+    return memcmp(header, "BSDIFF40", 8) == 0 ||
+           memcmp(header, "BSDIFFZ1", 8) == 0;
 }
 
 static off_t offtin(u_char *buf)
@@ -81,48 +101,224 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
-            return -1;
+// Each of the three compressed streams is decoded on its own thread into a
+// ring buffer of this size, which the patch loop reads from.  Decoding
+// is the bulk of the work, so this puts it on up to three more cores
+// and overlaps it with the add/copy loop, with memory use still fixed.
+#define RING_SIZE (256 * 1024)
+
+// At most this much is decoded before the consumer is told about it.
+#define DECODE_STEP (64 * 1024)
+
+typedef struct {
+    const char* name;
+    int zstd;               // zstd rather than bzip2 (BSDIFFZ1 patches)
+    bz_stream bz;
+#ifdef USE_ZSTD
+    ZSTD_DCtx* zs;
+    ZSTD_inBuffer zin;
+#endif
+    unsigned char* ring;
+    size_t head;            // total bytes taken by the consumer
+    size_t tail;            // total bytes decoded
+    int state;              // 0 while decoding, 1 at end of stream, -1 on error
+    int cancelled;
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DecodeStream;
+
+// Decode into the free space of the ring.  Called with ds->lock held;
+// drops it while the decompressor runs.  There must be free space.
+static void DecodeStep(DecodeStream* ds) {
+    size_t off = ds->tail % RING_SIZE;
+    size_t len = RING_SIZE - (ds->tail - ds->head);
+    if (len > RING_SIZE - off) len = RING_SIZE - off;
+    if (len > DECODE_STEP) len = DECODE_STEP;
+    pthread_mutex_unlock(&ds->lock);
+
+    int state = 0;
+    size_t got;
+#ifdef USE_ZSTD
+    if (ds->zstd) {
+        ZSTD_outBuffer zout = { ds->ring + off, len, 0 };
+        size_t ret = ZSTD_decompressStream(ds->zs, &zout, &ds->zin);
+        got = zout.pos;
+        if (ZSTD_isError(ret)) {
+            printf("zstd error \"%s\" decompressing %s stream\n",
+                   ZSTD_getErrorName(ret), ds->name);
+            state = -1;
+        } else if (ret == 0) {
+            state = 1;
+        } else if (got == 0 && ds->zin.pos == ds->zin.size) {
+            printf("%s stream is truncated\n", ds->name);
+            state = -1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+    } else
+#endif
+    {
+        ds->bz.next_out = (char*)ds->ring + off;
+        ds->bz.avail_out = len;
+        int bzerr = BZ2_bzDecompress(&ds->bz);
+        got = len - ds->bz.avail_out;
+        if (bzerr == BZ_STREAM_END) {
+            state = 1;
+        } else if (bzerr != BZ_OK) {
+            printf("bz error %d decompressing %s stream\n", bzerr, ds->name);
+            state = -1;
+        } else if (got == 0 && ds->bz.avail_in == 0) {
+            printf("%s stream is truncated\n", ds->name);
+            state = -1;
         }
     }
-    return 0;
+
+    pthread_mutex_lock(&ds->lock);
+    ds->tail += got;
+    ds->state = state;
+    pthread_cond_broadcast(&ds->cond);
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static void* DecodeThread(void* cookie) {
+    DecodeStream* ds = (DecodeStream*)cookie;
+    pthread_mutex_lock(&ds->lock);
+    while (ds->state == 0 && !ds->cancelled) {
+        if (ds->tail - ds->head == RING_SIZE) {
+            pthread_cond_wait(&ds->cond, &ds->lock);
+        } else {
+            DecodeStep(ds);
+        }
+    }
+    pthread_mutex_unlock(&ds->lock);
+    return NULL;
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+// Copy the next size bytes of the stream to buffer, waiting for the
+// decoder as needed.  If the decoder thread couldn't be started, decode
+// here instead.
+static int ReadStream(unsigned char* buffer, size_t size, DecodeStream* ds) {
+    int result = 0;
+    pthread_mutex_lock(&ds->lock);
+    while (size > 0) {
+        size_t avail = ds->tail - ds->head;
+        if (avail == 0) {
+            if (ds->state != 0) {
+                if (ds->state > 0) {
+                    printf("%s stream ended early\n", ds->name);
+                }
+                result = -1;
+                break;
+            }
+            if (ds->threaded) {
+                pthread_cond_wait(&ds->cond, &ds->lock);
+            } else {
+                DecodeStep(ds);
+            }
+            continue;
+        }
+        size_t off = ds->head % RING_SIZE;
+        size_t n = avail;
+        if (n > RING_SIZE - off) n = RING_SIZE - off;
+        if (n > size) n = size;
+        memcpy(buffer, ds->ring + off, n);
+        buffer += n;
+        size -= n;
+        ds->head += n;
+        pthread_cond_broadcast(&ds->cond);
     }
+    pthread_mutex_unlock(&ds->lock);
+    return result;
+}
+
+// The new file is produced this many bytes at a time, so memory use
+// doesn't grow with the size of the file (beyond the bzip2 state and
+// ring buffer of the three streams, which don't depend on it either).
+#define OUTPUT_CHUNK (64 * 1024)
 
-    if (sink(new_data, new_size, token) < new_size) {
+static int WriteOutput(unsigned char* data, ssize_t len,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (sink(data, len, token) < len) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+        return -1;
     }
     if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+        SHA_update(ctx, data, len);
+    }
+    return 0;
+}
+
+static void EndDecompress(DecodeStream* ds) {
+#ifdef USE_ZSTD
+    if (ds->zstd) {
+        ZSTD_freeDCtx(ds->zs);
+        return;
     }
-    free(new_data);
+#endif
+    BZ2_bzDecompressEnd(&ds->bz);
+}
 
+static int OpenStream(DecodeStream* ds, const char* name, int zstd,
+                      const unsigned char* data, ssize_t len) {
+    memset(ds, 0, sizeof(*ds));
+    ds->name = name;
+    ds->zstd = zstd;
+#ifdef USE_ZSTD
+    if (zstd) {
+        // Refuse frames that would need a bigger window than
+        // bsdiff_mem() ever writes, rather than allocating it.
+        ds->zs = ZSTD_createDCtx();
+        if (ds->zs == NULL ||
+            ZSTD_isError(ZSTD_DCtx_setParameter(ds->zs, ZSTD_d_windowLogMax,
+                                                BSDIFFZ1_WINDOW_LOG))) {
+            printf("failed to init zstd %s stream\n", name);
+            ZSTD_freeDCtx(ds->zs);
+            return -1;
+        }
+        ds->zin.src = data;
+        ds->zin.size = len;
+        ds->zin.pos = 0;
+    } else
+#endif
+    {
+        ds->bz.next_in = (char*)data;
+        ds->bz.avail_in = len;
+        int bzerr = BZ2_bzDecompressInit(&ds->bz, 0, 0);
+        if (bzerr != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", name, bzerr);
+            return -1;
+        }
+    }
+    ds->ring = malloc(RING_SIZE);
+    if (ds->ring == NULL) {
+        printf("failed to allocate %s stream buffer\n", name);
+        EndDecompress(ds);
+        return -1;
+    }
+    pthread_mutex_init(&ds->lock, NULL);
+    pthread_cond_init(&ds->cond, NULL);
+    ds->threaded = pthread_create(&ds->thread, NULL, DecodeThread, ds) == 0;
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+static void CloseStream(DecodeStream* ds) {
+    pthread_mutex_lock(&ds->lock);
+    ds->cancelled = 1;
+    pthread_cond_broadcast(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+    if (ds->threaded) {
+        pthread_join(ds->thread, NULL);
+    }
+    pthread_cond_destroy(&ds->cond);
+    pthread_mutex_destroy(&ds->lock);
+    free(ds->ring);
+    EndDecompress(ds);
+}
+
+// Check the header of the patch at patch->data + patch_offset, and
+// return the size of the new file, or -1 if it's corrupt.  *zstd is
+// set for BSDIFFZ1 patches.
+static ssize_t ParseHeader(const Value* patch, ssize_t patch_offset,
+                           ssize_t* ctrl_len, ssize_t* data_len, int* zstd) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -134,72 +330,81 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // with control block a set of triples (x,y,z) meaning "add x bytes
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
+    //
+    // BSDIFFZ1 is the same, with each block a zstd frame instead,
+    // which decodes several times faster.
 
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    if (patch->size - patch_offset < 32 || !IsBSDiffPatch(header)) {
         printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
+        return -1;
     }
+    *zstd = memcmp(header, "BSDIFFZ1", 8) == 0;
+#ifndef USE_ZSTD
+    if (*zstd) {
+        printf("BSDIFFZ1 patches aren't supported in this build\n");
+        return -1;
+    }
+#endif
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
+    ssize_t new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (*ctrl_len < 0 || *data_len < 0 || new_size < 0 ||
+        *ctrl_len + *data_len > patch->size - patch_offset - 32) {
         printf("corrupt patch file header (data lengths)\n");
-        return 1;
+        return -1;
     }
+    return new_size;
+}
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t ctrl_len, data_len;
+    int zstd;
+    ssize_t new_size = ParseHeader(patch, patch_offset, &ctrl_len, &data_len,
+                                   &zstd);
+    if (new_size < 0) {
+        return 1;
     }
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    const unsigned char* blocks =
+        (const unsigned char*) patch->data + patch_offset + 32;
+    DecodeStream cstream, dstream, estream;
+    if (OpenStream(&cstream, "control", zstd, blocks, ctrl_len) != 0) {
+        return 1;
     }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    if (OpenStream(&dstream, "diff", zstd, blocks + ctrl_len, data_len) != 0) {
+        CloseStream(&cstream);
+        return 1;
     }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    if (OpenStream(&estream, "extra", zstd, blocks + ctrl_len + data_len,
+                   patch->size - (patch_offset + 32 + ctrl_len + data_len))
+        != 0) {
+        CloseStream(&cstream);
+        CloseStream(&dstream);
         return 1;
     }
 
+    int result = 1;
+    unsigned char* buffer = malloc(OUTPUT_CHUNK);
+    if (buffer == NULL) {
+        printf("failed to allocate output buffer\n");
+        goto done;
+    }
+
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    off_t left;
+    int i, n;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadStream(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
@@ -207,51 +412,110 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
         if (ctrl[0] < 0 || ctrl[1] < 0) {
             printf("corrupt patch (negative byte counts)\n");
-            return 1;
+            goto done;
         }
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it
+        for (left = ctrl[0]; left > 0; left -= n) {
+            n = left < OUTPUT_CHUNK ? left : OUTPUT_CHUNK;
+            if (ReadStream(buffer, n, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
             }
+            for (i = 0; i < n; ++i) {
+                if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                    buffer[i] += old_data[oldpos+i];
+                }
+            }
+            if (WriteOutput(buffer, n, sink, token, ctx) != 0) {
+                goto done;
+            }
+            // Adjust pointers
+            newpos += n;
+            oldpos += n;
         }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
-
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        for (left = ctrl[1]; left > 0; left -= n) {
+            n = left < OUTPUT_CHUNK ? left : OUTPUT_CHUNK;
+            if (ReadStream(buffer, n, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            if (WriteOutput(buffer, n, sink, token, ctx) != 0) {
+                goto done;
+            }
+            newpos += n;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    result = 0;
+
+  done:
+    free(buffer);
+    CloseStream(&cstream);
+    CloseStream(&dstream);
+    CloseStream(&estream);
+    return result;
+}
+
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t pos;
+} MemoryOutput;
+
+static ssize_t MemoryOutputSink(unsigned char* data, ssize_t len,
+                                void* token) {
+    MemoryOutput* out = (MemoryOutput*)token;
+    if (out->size - out->pos < len) {
+        return -1;
+    }
+    memcpy(out->buffer + out->pos, data, len);
+    out->pos += len;
+    return len;
+}
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    ssize_t ctrl_len, data_len;
+    int zstd;
+    *new_size = ParseHeader(patch, patch_offset, &ctrl_len, &data_len, &zstd);
+    if (*new_size < 0) {
+        return 1;
+    }
+
+    *new_data = malloc(*new_size);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    MemoryOutput out;
+    out.buffer = *new_data;
+    out.size = *new_size;
+    out.pos = 0;
+    if (ApplyBSDiffPatch(old_data, old_size, patch, patch_offset,
+                         MemoryOutputSink, &out, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
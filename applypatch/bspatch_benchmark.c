@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compare how fast BSDIFF40 (bzip2) and BSDIFFZ1 (zstd) patches of the
+// same pair of files apply.
+//
+//   bspatch_benchmark [-n <runs>] <old-file> <new-file>
+//   bspatch_benchmark [-n <runs>] -s <megabytes>     (synthetic data)
+//
+// Both patches are made with bsdiff_mem(), then each is applied <runs>
+// times (default 5) with ApplyBSDiffPatchMem() and checked against the
+// new file.  Throughput is bytes of new file per second, best run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "applypatch.h"
+#include "benchmark_utils.h"
+#include "bsdiff.h"
+
+// An "old" file of repeated records and noise, and a "new" one with
+// scattered edits, insertions and a fresh tail, roughly like two
+// builds of the same binary.
+static void synthesize(off_t size, unsigned char** old_data, off_t* old_size,
+                       unsigned char** new_data, off_t* new_size) {
+  unsigned char* old = malloc(size + 1);
+  unsigned char record[256];
+  off_t i = 0;
+  int j;
+  srand(1);
+  while (i < size) {
+    int len = 16 + rand() % 240;
+    for (j = 0; j < len; ++j) record[j] = rand() % 16;
+    int copies = 1 + rand() % 32;
+    while (copies-- > 0) {
+      record[rand() % len] = rand();
+      for (j = 0; j < len && i < size; ++j) old[i++] = record[j];
+    }
+  }
+
+  unsigned char* new = malloc(size + size / 8 + 1);
+  off_t o = 0, n = 0;
+  while (o < size * 15 / 16) {
+    off_t run = 1000 + rand() % 20000;
+    if (run > size * 15 / 16 - o) run = size * 15 / 16 - o;
+    memcpy(new + n, old + o, run);
+    for (j = 0; j < 8 && run > 0; ++j) new[n + rand() % run] += 4;
+    n += run;
+    o += run;
+    if (rand() % 4 == 0) {
+      int insert = rand() % 200;
+      for (j = 0; j < insert; ++j) new[n++] = rand();
+    } else {
+      o += rand() % 100;
+    }
+  }
+  while (n < size) new[n++] = rand();
+
+  *old_data = old;
+  *old_size = size;
+  *new_data = new;
+  *new_size = n;
+}
+
+static int bench(const char* name, int format, unsigned char* old_data,
+                 off_t old_size, SuffixArray** sa, unsigned char* new_data,
+                 off_t new_size, int runs) {
+  u_char* patch_data;
+  off_t patch_len;
+  double start = BenchmarkNow();
+  if (bsdiff_mem(old_data, old_size, sa, new_data, new_size, format,
+                 &patch_data, &patch_len) != 0) {
+    printf("%s: failed to make patch\n", name);
+    return -1;
+  }
+  double make_time = BenchmarkNow() - start;
+
+  Value patch;
+  patch.type = VAL_BLOB;
+  patch.size = patch_len;
+  patch.data = (char*)patch_data;
+  patch.backing = NULL;
+
+  double best = 0;
+  int result = 0;
+  int i;
+  for (i = 0; i < runs && result == 0; ++i) {
+    unsigned char* out;
+    ssize_t out_size;
+    start = BenchmarkNow();
+    if (ApplyBSDiffPatchMem(old_data, old_size, &patch, 0,
+                            &out, &out_size) != 0) {
+      printf("%s: failed to apply patch\n", name);
+      result = -1;
+      break;
+    }
+    double t = BenchmarkNow() - start;
+    if (out_size != new_size || memcmp(out, new_data, new_size) != 0) {
+      printf("%s: patch produced the wrong output\n", name);
+      result = -1;
+    }
+    free(out);
+    if (i == 0 || t < best) best = t;
+  }
+
+  if (result == 0) {
+    printf("  %-8s patch %10lld bytes  made in %7.2f s  "
+           "applied in %7.3f s  %8.1f MB/s\n",
+           name, (long long)patch_len, make_time, best,
+           new_size / best / (1024 * 1024));
+  }
+  free(patch_data);
+  return result;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-n <runs>] <old-file> <new-file>\n"
+                  "       %s [-n <runs>] -s <megabytes>\n", prog, prog);
+}
+
+int main(int argc, char** argv) {
+  const char* prog = argv[0];
+  int runs = 5;
+  if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+    runs = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc != 3 || runs < 1) {
+    usage(prog);
+    return 2;
+  }
+
+  unsigned char* old_data;
+  unsigned char* new_data;
+  off_t old_size, new_size;
+  if (strcmp(argv[1], "-s") == 0) {
+    synthesize((off_t)atoi(argv[2]) << 20, &old_data, &old_size,
+               &new_data, &new_size);
+  } else {
+    old_data = BenchmarkReadFile(argv[1], &old_size);
+    new_data = BenchmarkReadFile(argv[2], &new_size);
+    if (old_data == NULL || new_data == NULL) return 1;
+  }
+  printf("old %lld bytes, new %lld bytes, best of %d runs:\n",
+         (long long)old_size, (long long)new_size, runs);
+
+  SuffixArray* sa = NULL;
+  int result = 0;
+  if (bench("BSDIFF40", BSDIFF_FORMAT_BZIP2, old_data, old_size, &sa,
+            new_data, new_size, runs) != 0) {
+    result = -1;
+  }
+#ifdef USE_ZSTD
+  if (bench("BSDIFFZ1", BSDIFF_FORMAT_ZSTD, old_data, old_size, &sa,
+            new_data, new_size, runs) != 0) {
+    result = -1;
+  }
+#else
+  printf("  BSDIFFZ1 not built in (ENABLE_ZSTD_PATCH)\n");
+#endif
+
+  FreeSuffixArray(sa);
+  free(old_data);
+  free(new_data);
+  return result == 0 ? 0 : 1;
+}
@@ -111,6 +111,9 @@
  *
  * After the header there are 'chunk count' bsdiff patches; the offset
  * of each from the beginning of the file is specified in the header.
+ * With --zstd they are BSDIFFZ1 rather than BSDIFF40 patches, which
+ * take a newer applypatch but decode several times faster.  Both tools
+ * must be built with ENABLE_ZSTD_PATCH for that.
  *
  * This tool can take an optional file of "bonus data".  This is an
  * extra file of data that is appended to chunk #1 after it is
@@ -122,6 +125,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,6 +134,7 @@
 #include <sys/types.h>
 
 #include "zlib.h"
+#include "bsdiff.h"
 #include "imgdiff.h"
 #include "utils.h"
 
@@ -143,7 +148,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  SuffixArray* sa;      // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -178,10 +183,6 @@ static int fileentry_compare(const void* a, const void* b) {
   }
 }
 
-// from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
-
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
                        int include_pseudo_chunk) {
@@ -293,7 +294,7 @@ unsigned char* ReadZip(const char* filename,
     curr->len = st.st_size;
     curr->data = img;
     curr->filename = NULL;
-    curr->I = NULL;
+    curr->sa = NULL;
     ++curr;
     ++*num_chunks;
   }
@@ -308,7 +309,7 @@ unsigned char* ReadZip(const char* filename,
       curr->deflate_len = temp_entries[nextentry].deflate_len;
       curr->deflate_data = img + pos;
       curr->filename = temp_entries[nextentry].filename;
-      curr->I = NULL;
+      curr->sa = NULL;
 
       curr->len = temp_entries[nextentry].uncomp_len;
       curr->data = malloc(curr->len);
@@ -353,7 +354,7 @@ unsigned char* ReadZip(const char* filename,
     }
     curr->data = img + pos;
     curr->filename = NULL;
-    curr->I = NULL;
+    curr->sa = NULL;
     pos += curr->len;
 
     ++*num_chunks;
@@ -418,7 +419,7 @@ unsigned char* ReadImage(const char* filename,
       curr->type = CHUNK_NORMAL;
       curr->len = GZIP_HEADER_LEN;
       curr->data = p;
-      curr->I = NULL;
+      curr->sa = NULL;
 
       pos += curr->len;
       p += curr->len;
@@ -426,7 +427,7 @@ unsigned char* ReadImage(const char* filename,
 
       curr->type = CHUNK_DEFLATE;
       curr->filename = NULL;
-      curr->I = NULL;
+      curr->sa = NULL;
 
       // We must decompress this chunk in order to discover where it
       // ends, and so we can put the uncompressed data and its length
@@ -472,7 +473,7 @@ unsigned char* ReadImage(const char* filename,
       curr->start = pos;
       curr->len = GZIP_FOOTER_LEN;
       curr->data = img+pos;
-      curr->I = NULL;
+      curr->sa = NULL;
 
       pos += curr->len;
       p += curr->len;
@@ -496,7 +497,7 @@ unsigned char* ReadImage(const char* filename,
       *chunks = realloc(*chunks, *num_chunks * sizeof(ImageChunk));
       ImageChunk* curr = *chunks + (*num_chunks-1);
       curr->start = pos;
-      curr->I = NULL;
+      curr->sa = NULL;
 
       // 'pos' is not the offset of the start of a gzip chunk, so scan
       // forward until we find a gzip header.
@@ -599,12 +600,13 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
 }
 
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Given source and target chunks, compute a bsdiff patch between them.
+ * Return the patch data, placing its length in *size.  Return NULL on
+ * failure.  src_lock guards the building of src's suffix array, which
+ * other threads making patches from the same source chunk share.
  */
-unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
+unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt,
+                         pthread_mutex_t* src_lock, int format, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
     if (tgt->len <= 160) {
       tgt->type = CHUNK_RAW;
@@ -613,46 +615,34 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
     }
   }
 
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
-
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
-  if (r != 0) {
-    printf("bsdiff() failed: %d\n", r);
+  pthread_mutex_lock(src_lock);
+  if (src->sa == NULL) {
+    src->sa = BuildSuffixArray(src->data, src->len, SUFFIX_SORT_DEFAULT);
+  }
+  pthread_mutex_unlock(src_lock);
+  if (src->sa == NULL) {
+    printf("failed to sort suffixes of source chunk\n");
     return NULL;
   }
 
-  struct stat st;
-  if (stat(ptemp, &st) != 0) {
-    printf("failed to stat patch file %s: %s\n",
-            ptemp, strerror(errno));
+  u_char* data;
+  off_t data_len;
+  int r = bsdiff_mem(src->data, src->len, &(src->sa), tgt->data, tgt->len,
+                     format, &data, &data_len);
+  if (r != 0) {
+    printf("bsdiff() failed: %d\n", r);
     return NULL;
   }
 
-  unsigned char* data = malloc(st.st_size);
-
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= data_len) {
+    free(data);
 
     tgt->type = CHUNK_RAW;
     *size = tgt->len;
     return tgt->data;
   }
 
-  *size = st.st_size;
-
-  FILE* f = fopen(ptemp, "rb");
-  if (f == NULL) {
-    printf("failed to open patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  if (fread(data, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  fclose(f);
-
-  unlink(ptemp);
+  *size = data_len;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -668,6 +658,40 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+typedef struct {
+  ImageChunk* src_chunks;
+  ImageChunk* tgt_chunks;
+  ImageChunk** patch_src;           // source chunk for each target chunk
+  pthread_mutex_t* src_locks;       // one per source chunk
+  int format;                       // BSDIFF_FORMAT_*
+  unsigned char** patch_data;
+  size_t* patch_size;
+  int count;
+  int next;                         // next target chunk to take
+  pthread_mutex_t lock;
+} PatchJobs;
+
+/*
+ * Make patches for target chunks until there are none left.  Each
+ * result goes in its own slot, so the output is in chunk order however
+ * the work is spread over threads.
+ */
+static void* MakePatches(void* cookie) {
+  PatchJobs* jobs = (PatchJobs*)cookie;
+  for (;;) {
+    pthread_mutex_lock(&jobs->lock);
+    int i = jobs->next++;
+    pthread_mutex_unlock(&jobs->lock);
+    if (i >= jobs->count) break;
+
+    ImageChunk* src = jobs->patch_src[i];
+    jobs->patch_data[i] = MakePatch(src, jobs->tgt_chunks+i,
+                                    jobs->src_locks + (src - jobs->src_chunks),
+                                    jobs->format, jobs->patch_size+i);
+  }
+  return NULL;
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -781,6 +805,17 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 
 int main(int argc, char** argv) {
   int zip_mode = 0;
+  int format = BSDIFF_FORMAT_BZIP2;
+
+  if (argc >= 2 && strcmp(argv[1], "--zstd") == 0) {
+#ifndef USE_ZSTD
+    fprintf(stderr, "--zstd needs an imgdiff built with ENABLE_ZSTD_PATCH\n");
+    return 1;
+#endif
+    format = BSDIFF_FORMAT_ZSTD;
+    --argc;
+    ++argv;
+  }
 
   if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
     zip_mode = 1;
@@ -815,7 +850,7 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [--zstd] [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -946,15 +981,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1000,48 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
+    }
+  }
+
+  // The chunks are independent (apart from sharing source chunks'
+  // suffix arrays), so diff them on a pool of threads.
+  PatchJobs jobs;
+  jobs.src_chunks = src_chunks;
+  jobs.tgt_chunks = tgt_chunks;
+  jobs.patch_src = patch_src;
+  jobs.src_locks = malloc(num_src_chunks * sizeof(pthread_mutex_t));
+  jobs.patch_data = patch_data;
+  jobs.patch_size = patch_size;
+  jobs.format = format;
+  jobs.count = num_tgt_chunks;
+  jobs.next = 0;
+  pthread_mutex_init(&jobs.lock, NULL);
+  for (i = 0; i < num_src_chunks; ++i) {
+    pthread_mutex_init(jobs.src_locks+i, NULL);
+  }
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_tgt_chunks) num_threads = num_tgt_chunks;
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  for (i = 1; i < num_threads; ++i) {
+    if (pthread_create(threads+started, NULL, MakePatches, &jobs) == 0) {
+      ++started;
+    }
+  }
+  MakePatches(&jobs);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(patch_src);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to make patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
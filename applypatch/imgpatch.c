@@ -18,6 +18,7 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -29,6 +30,53 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+#define DEFLATE_BUFFER 32768
+
+// Recompresses a deflate chunk's target data as the bsdiff patch
+// produces it, so the uncompressed target is never held in memory.
+typedef struct {
+    z_stream strm;
+    unsigned char* buffer;
+    ssize_t size;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} DeflateOutput;
+
+static int DeflateChunk(DeflateOutput* out, unsigned char* data,
+                        ssize_t len, int flush) {
+    out->strm.next_in = data;
+    out->strm.avail_in = len;
+    int ret;
+    do {
+        out->strm.avail_out = out->size;
+        out->strm.next_out = out->buffer;
+        ret = deflate(&out->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            printf("deflate failed\n");
+            return -1;
+        }
+        ssize_t have = out->size - out->strm.avail_out;
+        if (have > 0) {
+            if (out->sink(out->buffer, have, out->token) != have) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)have);
+                return -1;
+            }
+            SHA_update(out->ctx, out->buffer, have);
+        }
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END
+                               : out->strm.avail_out == 0);
+    return 0;
+}
+
+static ssize_t DeflateSink(unsigned char* data, ssize_t len, void* token) {
+    if (DeflateChunk((DeflateOutput*)token, data, len, Z_NO_FLUSH) != 0) {
+        return -1;
+    }
+    return len;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -173,55 +221,62 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                        bonus_data->data, bonus_size);
             }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+            // Next, apply the bsdiff patch to the uncompressed data,
+            // and compress the result onto the output as it's
+            // produced.
+            DeflateOutput out;
+            out.sink = sink;
+            out.token = token;
+            out.ctx = ctx;
+            // Stored blocks are cut wherever deflate() runs out of
+            // input or output space, so level 0 needs the whole target
+            // at once and the original's output buffer size to
+            // reproduce it.
+            out.size = DEFLATE_BUFFER;
+            if (level == 0 && (ssize_t)expanded_len > out.size) {
+                out.size = expanded_len;
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            out.buffer = malloc(out.size);
+            out.strm.zalloc = Z_NULL;
+            out.strm.zfree = Z_NULL;
+            out.strm.opaque = Z_NULL;
+            if (out.buffer == NULL ||
+                deflateInit2(&out.strm, level, method, windowBits,
+                             memLevel, strategy) != Z_OK) {
+                printf("failed to init target deflation\n");
+                free(out.buffer);
+                free(expanded_source);
+                return -1;
             }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
+            int result;
+            if (level == 0) {
+                unsigned char* uncompressed_target_data;
+                ssize_t uncompressed_target_size;
+                result = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                                             patch, patch_offset,
+                                             &uncompressed_target_data,
+                                             &uncompressed_target_size);
+                if (result == 0) {
+                    result = DeflateChunk(&out, uncompressed_target_data,
+                                          uncompressed_target_size, Z_FINISH);
+                    free(uncompressed_target_data);
                 }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+            } else {
+                result = ApplyBSDiffPatch(expanded_source, expanded_len,
+                                          patch, patch_offset,
+                                          DeflateSink, &out, NULL);
+                if (result == 0) {
+                    result = DeflateChunk(&out, NULL, 0, Z_FINISH);
+                }
+            }
+            deflateEnd(&out.strm);
+            free(out.buffer);
+            free(expanded_source);
+            if (result != 0) {
+                printf("failed to write chunk %d deflate data\n", i);
+                return -1;
+            }
         } else {
             printf("patch chunk %d is unknown type %d\n", i, type);
             return -1;
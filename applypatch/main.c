@@ -81,6 +81,7 @@ static int ParsePatchArgs(int argc, char** argv,
             (*patches)[i]->type = VAL_BLOB;
             (*patches)[i]->size = fc.size;
             (*patches)[i]->data = (char*)fc.data;
+            (*patches)[i]->backing = NULL;
         }
     }
 
@@ -111,6 +112,7 @@ int PatchMode(int argc, char** argv) {
         bonus->type = VAL_BLOB;
         bonus->size = fc.size;
         bonus->data = (char*)fc.data;
+        bonus->backing = NULL;
         argc -= 2;
         argv += 2;
     }
@@ -40,11 +40,15 @@ void ui_clear_key_queue();
 // The screen is small, and users may need to report these messages to support,
 // so keep the output short and not too cryptic.
 void ui_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// Like ui_print("%s", text) with no length limit; the screen is redrawn
+// once for the whole string.
+void ui_print_text(const char *text);
 void ui_printlogtail(int nb_lines);
 
 void ui_delete_line();
 void ui_set_show_text(int value);
 int ui_get_text_cols();
+int ui_get_update_fps();
 void ui_setMenuTextColor(int r, int g, int b, int a);
 
 #ifdef ENABLE_LOKI
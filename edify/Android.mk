@@ -5,7 +5,9 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	compile.c \
+	profile.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -21,6 +23,7 @@ LOCAL_SRC_FILES := \
 		main.c
 
 LOCAL_CFLAGS := $(edify_cflags) -g -O0
+LOCAL_LDLIBS := -lpthread
 LOCAL_MODULE := edify
 LOCAL_YACCFLAGS := -v
 
@@ -0,0 +1,728 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+// The compiler turns the builtin operators (the ones the parser builds
+// for ';', '+', '==', '!=', '&&', '||', '!' and if/then/else, plus
+// concat(), is_substring() and ifelse() when called by name) into
+// bytecode for a small stack machine.  Anything else is a call to a
+// registered Function, made exactly as the tree walker makes it: the
+// function gets its own Expr* argv and evaluates its arguments itself.
+// Argument subtrees that are operators get bytecode of their own, which
+// Evaluate() and EvaluateValue() pick up.
+//
+// Before code generation, operators whose arguments are all literals
+// are evaluated once and replaced by the literal result, and
+// short-circuit operators with a literal condition are replaced by the
+// branch they would take.  Literal strings are interned, so each
+// distinct string is stored once.
+//
+// Like the parser, the compiler never frees Expr nodes; subtrees that
+// folding makes unreachable are simply dropped.
+
+enum {
+    OP_CONST,       // push a copy of consts[arg]
+    OP_CALL,        // push the result of calling calls[arg]
+    OP_STRING,      // fail unless the top of the stack is a string
+    OP_CONCAT,      // replace the top arg strings with their concatenation
+    OP_EQ,          // replace the top two strings with "t" or ""
+    OP_NE,
+    OP_SUBSTR,
+    OP_NOT,         // replace the top string with "t" or ""
+    OP_AND,         // if the top string is false, jump to arg; else pop it
+    OP_OR,          // if the top string is true, jump to arg; else pop it
+    OP_JUMP_FALSE,  // pop the top string; jump to arg if it was false
+    OP_JUMP,        // jump to arg
+    OP_POP,         // discard the top value
+};
+
+typedef struct {
+    int op;
+    int arg;
+} Instruction;
+
+typedef struct {
+    char* str;
+    size_t len;
+} Constant;
+
+struct Program {
+    Instruction* code;
+    int length;
+    const Constant** consts;
+    int const_count;
+    Expr** calls;
+    int call_count;
+    int max_depth;
+};
+
+// ---------------------------------------------------------------------
+//   interned strings
+// ---------------------------------------------------------------------
+
+typedef struct {
+    Constant** slots;
+    int size;       // always a power of two
+    int count;
+} ConstantPool;
+
+static unsigned int
+hash_string(const char* s) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static void
+pool_insert(ConstantPool* pool, Constant* c) {
+    unsigned int i = hash_string(c->str) & (pool->size - 1);
+    while (pool->slots[i] != NULL) {
+        i = (i + 1) & (pool->size - 1);
+    }
+    pool->slots[i] = c;
+    ++pool->count;
+}
+
+// Return the pool's copy of str, adding one if it's new.  Takes
+// ownership of str, which must be malloc'd.
+static Constant*
+intern(ConstantPool* pool, char* str) {
+    if (pool->size > 0) {
+        unsigned int i = hash_string(str) & (pool->size - 1);
+        while (pool->slots[i] != NULL) {
+            if (strcmp(pool->slots[i]->str, str) == 0) {
+                if (pool->slots[i]->str != str) free(str);
+                return pool->slots[i];
+            }
+            i = (i + 1) & (pool->size - 1);
+        }
+    }
+
+    if ((pool->count + 1) * 2 > pool->size) {
+        Constant** old = pool->slots;
+        int old_size = pool->size;
+        pool->size = old_size ? old_size * 2 : 64;
+        pool->slots = calloc(pool->size, sizeof(Constant*));
+        pool->count = 0;
+        int i;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i] != NULL) pool_insert(pool, old[i]);
+        }
+        free(old);
+    }
+
+    Constant* c = malloc(sizeof(Constant));
+    c->str = str;
+    c->len = strlen(str);
+    pool_insert(pool, c);
+    return c;
+}
+
+// ---------------------------------------------------------------------
+//   constant folding
+// ---------------------------------------------------------------------
+
+static bool
+is_literal(const Expr* e) {
+    return e->fn == Literal;
+}
+
+// Operators with no side effects of their own, and the argument counts
+// the compiler understands them with.
+static bool
+is_pure_operator(const Expr* e) {
+    if (e->fn == ConcatFn) return true;
+    if (e->fn == EqualityFn || e->fn == InequalityFn ||
+        e->fn == SubstringFn || e->fn == LogicalAndFn ||
+        e->fn == LogicalOrFn || e->fn == SequenceFn) {
+        return e->argc == 2;
+    }
+    if (e->fn == LogicalNotFn) return e->argc == 1;
+    if (e->fn == IfElseFn) return e->argc == 2 || e->argc == 3;
+    return false;
+}
+
+// Overwrite e with a copy of other, keeping e's source range so that
+// assert() still quotes what the script said.
+static void
+replace_expr(Expr* e, const Expr* other) {
+    int start = e->start;
+    int end = e->end;
+    *e = *other;
+    e->start = start;
+    e->end = end;
+}
+
+static void
+make_literal(Expr* e, char* str) {
+    e->fn = Literal;
+    e->name = str;
+    e->argc = 0;
+    e->argv = NULL;
+    e->code = NULL;
+}
+
+static void
+fold(Expr* e) {
+    if (!is_pure_operator(e)) {
+        int i;
+        for (i = 0; i < e->argc; ++i) fold(e->argv[i]);
+        return;
+    }
+
+    if (e->argc == 0) {     // concat()
+        make_literal(e, strdup(""));
+        return;
+    }
+
+    // The first argument of a short-circuiting operator decides which of
+    // the others is ever evaluated.
+    fold(e->argv[0]);
+    if (is_literal(e->argv[0])) {
+        bool b = e->argv[0]->name[0] != '\0';
+        if (e->fn == SequenceFn) {
+            replace_expr(e, e->argv[1]);
+            fold(e);
+            return;
+        }
+        if (e->fn == LogicalAndFn || e->fn == IfElseFn) {
+            if (b) {
+                replace_expr(e, e->argv[1]);
+                fold(e);
+            } else if (e->fn == IfElseFn && e->argc == 3) {
+                replace_expr(e, e->argv[2]);
+                fold(e);
+            } else {
+                make_literal(e, e->argv[0]->name);
+            }
+            return;
+        }
+        if (e->fn == LogicalOrFn) {
+            if (b) {
+                make_literal(e, e->argv[0]->name);
+            } else {
+                replace_expr(e, e->argv[1]);
+                fold(e);
+            }
+            return;
+        }
+    }
+
+    int i;
+    bool all_literal = is_literal(e->argv[0]);
+    for (i = 1; i < e->argc; ++i) {
+        fold(e->argv[i]);
+        all_literal = all_literal && is_literal(e->argv[i]);
+    }
+    if (!all_literal) return;
+
+    // Every argument is a literal, so running the operator now gives
+    // the same answer it would give every time.
+    State scratch;
+    scratch.cookie = NULL;
+    scratch.script = NULL;
+    scratch.errmsg = NULL;
+    Value* v = e->fn(e->name, &scratch, e->argc, e->argv);
+    free(scratch.errmsg);
+    if (v == NULL) return;
+    if (v->type == VAL_STRING) {
+        make_literal(e, v->data);
+        free(v);
+    } else {
+        FreeValue(v);
+    }
+}
+
+// ---------------------------------------------------------------------
+//   code generation
+// ---------------------------------------------------------------------
+
+typedef struct {
+    Program* prog;
+    int code_size;
+    int consts_size;
+    int calls_size;
+    int depth;
+    ConstantPool* pool;
+} Compiler;
+
+static void compile_tree(Expr* e, ConstantPool* pool);
+
+static int
+emit(Compiler* c, int op, int arg) {
+    Program* p = c->prog;
+    if (p->length >= c->code_size) {
+        c->code_size = c->code_size * 2 + 16;
+        p->code = realloc(p->code, c->code_size * sizeof(Instruction));
+    }
+    p->code[p->length].op = op;
+    p->code[p->length].arg = arg;
+    return p->length++;
+}
+
+static void
+push(Compiler* c) {
+    if (++c->depth > c->prog->max_depth) c->prog->max_depth = c->depth;
+}
+
+static void
+emit_const(Compiler* c, Expr* literal) {
+    Program* p = c->prog;
+    Constant* k = intern(c->pool, literal->name);
+    literal->name = k->str;
+    int i;
+    for (i = 0; i < p->const_count; ++i) {
+        if (p->consts[i] == k) break;
+    }
+    if (i == p->const_count) {
+        if (p->const_count >= c->consts_size) {
+            c->consts_size = c->consts_size * 2 + 4;
+            p->consts = realloc(p->consts,
+                                c->consts_size * sizeof(Constant*));
+        }
+        p->consts[p->const_count++] = k;
+    }
+    emit(c, OP_CONST, i);
+    push(c);
+}
+
+static void
+emit_call(Compiler* c, Expr* e) {
+    Program* p = c->prog;
+    if (p->call_count >= c->calls_size) {
+        c->calls_size = c->calls_size * 2 + 4;
+        p->calls = realloc(p->calls, c->calls_size * sizeof(Expr*));
+    }
+    p->calls[p->call_count] = e;
+    emit(c, OP_CALL, p->call_count++);
+    push(c);
+
+    // The function evaluates its arguments itself, through Evaluate().
+    int i;
+    for (i = 0; i < e->argc; ++i) compile_tree(e->argv[i], c->pool);
+}
+
+// Emit code that leaves e's value on the stack.  Returns true if that
+// value is known to be a string.
+static bool gen(Compiler* c, Expr* e);
+
+// Emit code for an operand the tree walker would read with Evaluate(),
+// which fails as soon as it sees a non-string.
+static void
+gen_string(Compiler* c, Expr* e) {
+    if (!gen(c, e)) emit(c, OP_STRING, 0);
+}
+
+static void
+patch(Compiler* c, int at) {
+    c->prog->code[at].arg = c->prog->length;
+}
+
+static bool
+gen(Compiler* c, Expr* e) {
+    if (is_literal(e)) {
+        emit_const(c, e);
+        return true;
+    }
+    if (!is_pure_operator(e)) {
+        emit_call(c, e);
+        return false;
+    }
+
+    int i;
+    if (e->fn == ConcatFn) {
+        // fold() has already turned concat() into "".
+        for (i = 0; i < e->argc; ++i) gen_string(c, e->argv[i]);
+        emit(c, OP_CONCAT, e->argc);
+        c->depth -= e->argc - 1;
+        return true;
+    }
+    if (e->fn == EqualityFn || e->fn == InequalityFn ||
+        e->fn == SubstringFn) {
+        gen_string(c, e->argv[0]);
+        gen_string(c, e->argv[1]);
+        emit(c, e->fn == EqualityFn ? OP_EQ :
+                e->fn == InequalityFn ? OP_NE : OP_SUBSTR, 0);
+        --c->depth;
+        return true;
+    }
+    if (e->fn == LogicalNotFn) {
+        gen_string(c, e->argv[0]);
+        emit(c, OP_NOT, 0);
+        return true;
+    }
+    if (e->fn == SequenceFn) {
+        gen(c, e->argv[0]);
+        emit(c, OP_POP, 0);
+        --c->depth;
+        return gen(c, e->argv[1]);
+    }
+    if (e->fn == LogicalAndFn || e->fn == LogicalOrFn ||
+        (e->fn == IfElseFn && e->argc == 2)) {
+        // ifelse(c, a) is c && a: a false condition is the result.
+        gen_string(c, e->argv[0]);
+        int jump = emit(c, e->fn == LogicalOrFn ? OP_OR : OP_AND, 0);
+        --c->depth;
+        bool s = gen(c, e->argv[1]);
+        patch(c, jump);
+        return s;
+    }
+    // ifelse(c, a, b)
+    gen_string(c, e->argv[0]);
+    int to_else = emit(c, OP_JUMP_FALSE, 0);
+    --c->depth;
+    bool s1 = gen(c, e->argv[1]);
+    int to_end = emit(c, OP_JUMP, 0);
+    --c->depth;
+    patch(c, to_else);
+    bool s2 = gen(c, e->argv[2]);
+    patch(c, to_end);
+    return s1 && s2;
+}
+
+// Give e bytecode if it's an operator, and look further down the tree
+// for arguments of function calls that are.
+static void
+compile_tree(Expr* e, ConstantPool* pool) {
+    if (is_literal(e)) {
+        Constant* k = intern(pool, e->name);
+        e->name = k->str;
+        return;
+    }
+    if (!is_pure_operator(e)) {
+        int i;
+        for (i = 0; i < e->argc; ++i) compile_tree(e->argv[i], pool);
+        return;
+    }
+
+    Compiler c;
+    memset(&c, 0, sizeof(c));
+    c.pool = pool;
+    c.prog = calloc(1, sizeof(Program));
+    gen(&c, e);
+    e->code = c.prog;
+}
+
+void CompileExpr(Expr* root) {
+    ConstantPool pool;
+    memset(&pool, 0, sizeof(pool));
+    fold(root);
+    compile_tree(root, &pool);
+    // The strings stay; only the lookup table goes.
+    free(pool.slots);
+}
+
+// ---------------------------------------------------------------------
+//   the evaluation arena
+// ---------------------------------------------------------------------
+
+// Values the interpreter makes and consumes itself (constants,
+// operator results, conditions) live in a per-thread bump allocator
+// instead of the heap.  Allocation is strictly LIFO: RunProgram() takes
+// a mark on entry, rolls back to it whenever a top-level statement
+// finishes, and again on exit.  A nested RunProgram() (for the argument
+// of a Function the outer program called) always returns before the
+// outer one continues, so its marks never cut into the outer one's
+// values.
+//
+// Arena Values never leave the interpreter.  Anything handed to a
+// Function or returned from RunProgram() is copied to the heap first
+// (escape_value()), because callers own those and free() them.
+
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* current;
+    ArenaChunk* spare;      // one released chunk, kept for reuse
+} Arena;
+
+typedef struct {
+    ArenaChunk* chunk;
+    size_t used;
+} ArenaMark;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void
+free_arena(void* cookie) {
+    Arena* a = cookie;
+    while (a->current != NULL) {
+        ArenaChunk* next = a->current->next;
+        free(a->current);
+        a->current = next;
+    }
+    free(a->spare);
+    free(a);
+}
+
+static void
+create_arena_key() {
+    pthread_key_create(&arena_key, free_arena);
+}
+
+static Arena*
+thread_arena() {
+    pthread_once(&arena_once, create_arena_key);
+    Arena* a = pthread_getspecific(arena_key);
+    if (a == NULL) {
+        a = calloc(1, sizeof(Arena));
+        pthread_setspecific(arena_key, a);
+    }
+    return a;
+}
+
+static void*
+arena_alloc(Arena* a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk* c = a->current;
+    if (c == NULL || c->size - c->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        if (a->spare != NULL && a->spare->size >= chunk_size) {
+            c = a->spare;
+            a->spare = NULL;
+        } else {
+            c = malloc(sizeof(ArenaChunk) + chunk_size);
+            c->size = chunk_size;
+        }
+        c->used = 0;
+        c->next = a->current;
+        a->current = c;
+    }
+    void* p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+static ArenaMark
+arena_mark(const Arena* a) {
+    ArenaMark m;
+    m.chunk = a->current;
+    m.used = a->current ? a->current->used : 0;
+    return m;
+}
+
+static void
+arena_release(Arena* a, ArenaMark m) {
+    while (a->current != m.chunk) {
+        ArenaChunk* c = a->current;
+        a->current = c->next;
+        if (a->spare == NULL && c->size == ARENA_CHUNK_SIZE) {
+            a->spare = c;
+        } else {
+            free(c);
+        }
+    }
+    if (a->current != NULL) a->current->used = m.used;
+}
+
+// ---------------------------------------------------------------------
+//   the interpreter
+// ---------------------------------------------------------------------
+
+typedef struct {
+    Value* v;
+    bool in_arena;      // v and v->data belong to the arena
+} Slot;
+
+static const char kTrue[] = "t";
+static const char kFalse[] = "";
+
+static Value*
+arena_value(Arena* a, char* data, size_t size) {
+    Value* v = arena_alloc(a, sizeof(Value));
+    v->type = VAL_STRING;
+    v->size = size;
+    v->data = data;
+    v->backing = NULL;
+    return v;
+}
+
+static Value*
+bool_value(Arena* a, bool b) {
+    return arena_value(a, (char*)(b ? kTrue : kFalse), b ? 1 : 0);
+}
+
+static void
+drop(Slot* s) {
+    if (!s->in_arena) FreeValue(s->v);
+}
+
+// Give the caller a heap copy of an arena Value.
+static Value*
+escape_value(Slot* s) {
+    if (!s->in_arena) return s->v;
+    Value* v = malloc(sizeof(Value));
+    v->type = s->v->type;
+    v->size = s->v->size;
+    v->data = malloc(v->size + 1);
+    memcpy(v->data, s->v->data, v->size + 1);
+    v->backing = NULL;
+    return v;
+}
+
+static bool
+is_true(const Value* v) {
+    return v->data[0] != '\0';
+}
+
+#define SMALL_STACK 16
+
+Value* RunProgram(State* state, Program* prog) {
+    Arena* arena = thread_arena();
+    ArenaMark entry = arena_mark(arena);
+    Slot small[SMALL_STACK];
+    Slot* stack = small;
+    if (prog->max_depth > SMALL_STACK) {
+        stack = arena_alloc(arena, prog->max_depth * sizeof(Slot));
+    }
+    ArenaMark start = arena_mark(arena);
+    int sp = 0;
+    int pc = 0;
+    Value* result = NULL;
+
+    while (pc < prog->length) {
+        const Instruction* in = prog->code + pc++;
+        switch (in->op) {
+            case OP_CONST: {
+                // Nothing modifies an arena Value, so the constant's
+                // own bytes can be used in place.
+                const Constant* k = prog->consts[in->arg];
+                stack[sp].v = arena_value(arena, k->str, k->len);
+                stack[sp++].in_arena = true;
+                break;
+            }
+
+            case OP_CALL: {
+                Expr* e = prog->calls[in->arg];
+                Value* v = gProfileCalls ? ProfileCall(state, e) :
+                        e->fn(e->name, state, e->argc, e->argv);
+                if (v == NULL) goto done;
+                stack[sp].v = v;
+                stack[sp++].in_arena = false;
+                break;
+            }
+
+            case OP_STRING:
+                if (stack[sp-1].v->type != VAL_STRING) {
+                    ErrorAbort(state, "expecting string, got value type %d",
+                               stack[sp-1].v->type);
+                    goto done;
+                }
+                break;
+
+            case OP_CONCAT: {
+                Slot* args = stack + sp - in->arg;
+                size_t length = 0;
+                int i;
+                for (i = 0; i < in->arg; ++i) {
+                    length += strlen(args[i].v->data);
+                }
+                char* joined = arena_alloc(arena, length + 1);
+                size_t p = 0;
+                for (i = 0; i < in->arg; ++i) {
+                    size_t n = strlen(args[i].v->data);
+                    memcpy(joined + p, args[i].v->data, n);
+                    p += n;
+                    drop(args + i);
+                }
+                joined[p] = '\0';
+                sp -= in->arg;
+                stack[sp].v = arena_value(arena, joined, p);
+                stack[sp++].in_arena = true;
+                break;
+            }
+
+            case OP_EQ:
+            case OP_NE:
+            case OP_SUBSTR: {
+                const char* left = stack[sp-2].v->data;
+                const char* right = stack[sp-1].v->data;
+                bool b;
+                if (in->op == OP_SUBSTR) {
+                    b = strstr(right, left) != NULL;
+                } else {
+                    b = (strcmp(left, right) == 0) == (in->op == OP_EQ);
+                }
+                drop(stack + sp - 1);
+                drop(stack + sp - 2);
+                --sp;
+                stack[sp-1].v = bool_value(arena, b);
+                stack[sp-1].in_arena = true;
+                break;
+            }
+
+            case OP_NOT: {
+                bool b = !is_true(stack[sp-1].v);
+                drop(stack + sp - 1);
+                stack[sp-1].v = bool_value(arena, b);
+                stack[sp-1].in_arena = true;
+                break;
+            }
+
+            case OP_AND:
+            case OP_OR:
+                if (is_true(stack[sp-1].v) == (in->op == OP_OR)) {
+                    pc = in->arg;
+                } else {
+                    drop(stack + --sp);
+                }
+                break;
+
+            case OP_JUMP_FALSE: {
+                bool b = is_true(stack[sp-1].v);
+                drop(stack + --sp);
+                if (!b) pc = in->arg;
+                break;
+            }
+
+            case OP_JUMP:
+                pc = in->arg;
+                break;
+
+            case OP_POP:
+                drop(stack + --sp);
+                // A statement just finished; nothing it allocated in the
+                // arena is still reachable.
+                if (sp == 0) arena_release(arena, start);
+                break;
+        }
+    }
+    --sp;
+    result = escape_value(stack + sp);
+
+  done:
+    while (sp > 0) drop(stack + --sp);
+    arena_release(arena, entry);
+    return result;
+}
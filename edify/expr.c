@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -33,7 +34,7 @@ int BooleanString(const char* s) {
 }
 
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    Value* v = EvaluateValue(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,6 +47,8 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
+    if (expr->code != NULL) return RunProgram(state, expr->code);
+    if (gProfileCalls) return ProfileCall(state, expr);
     return expr->fn(expr->name, state, expr->argc, expr->argv);
 }
 
@@ -55,12 +58,17 @@ Value* StringValue(char* str) {
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
+    v->backing = NULL;
     return v;
 }
 
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
+    if (v->backing != NULL) {
+        v->backing->release(v);
+    } else {
+        free(v->data);
+    }
     free(v);
 }
 
@@ -339,6 +347,7 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_end(v);
     e->start = loc.start;
     e->end = loc.end;
+    e->code = NULL;
     return e;
 }
 
@@ -350,16 +359,25 @@ static int fn_entries = 0;
 static int fn_size = 0;
 NamedFunction* fn_table = NULL;
 
-void RegisterFunction(const char* name, Function fn) {
+static void AddFunction(const char* name, Function fn, bool thread_safe) {
     if (fn_entries >= fn_size) {
         fn_size = fn_size*2 + 1;
         fn_table = realloc(fn_table, fn_size * sizeof(NamedFunction));
     }
     fn_table[fn_entries].name = name;
     fn_table[fn_entries].fn = fn;
+    fn_table[fn_entries].thread_safe = thread_safe;
     ++fn_entries;
 }
 
+void RegisterFunction(const char* name, Function fn) {
+    AddFunction(name, fn, false);
+}
+
+void RegisterThreadSafeFunction(const char* name, Function fn) {
+    AddFunction(name, fn, true);
+}
+
 static int fn_entry_compare(const void* a, const void* b) {
     const char* na = ((const NamedFunction*)a)->name;
     const char* nb = ((const NamedFunction*)b)->name;
@@ -382,19 +400,163 @@ Function FindFunction(const char* name) {
 }
 
 void RegisterBuiltins() {
-    RegisterFunction("ifelse", IfElseFn);
-    RegisterFunction("abort", AbortFn);
-    RegisterFunction("assert", AssertFn);
-    RegisterFunction("concat", ConcatFn);
-    RegisterFunction("is_substring", SubstringFn);
-    RegisterFunction("stdout", StdoutFn);
-    RegisterFunction("sleep", SleepFn);
+    RegisterThreadSafeFunction("ifelse", IfElseFn);
+    RegisterThreadSafeFunction("abort", AbortFn);
+    RegisterThreadSafeFunction("assert", AssertFn);
+    RegisterThreadSafeFunction("concat", ConcatFn);
+    RegisterThreadSafeFunction("is_substring", SubstringFn);
+    RegisterThreadSafeFunction("stdout", StdoutFn);
+    RegisterThreadSafeFunction("sleep", SleepFn);
+    RegisterThreadSafeFunction("parallel", ParallelFn);
 
-    RegisterFunction("less_than_int", LessThanIntFn);
-    RegisterFunction("greater_than_int", GreaterThanIntFn);
+    RegisterThreadSafeFunction("less_than_int", LessThanIntFn);
+    RegisterThreadSafeFunction("greater_than_int", GreaterThanIntFn);
 }
 
 
+// -----------------------------------------------------------------
+//   parallel()
+// -----------------------------------------------------------------
+
+// Most threads parallel() will use, including the calling one.
+#define PARALLEL_MAX_THREADS 4
+
+static bool IsThreadSafe(Function fn) {
+    // The operators the parser builds aren't in the function table.
+    if (fn == Literal || fn == SequenceFn || fn == ConcatFn ||
+        fn == EqualityFn || fn == InequalityFn || fn == SubstringFn ||
+        fn == LogicalAndFn || fn == LogicalOrFn || fn == LogicalNotFn ||
+        fn == IfElseFn) {
+        return true;
+    }
+    int i;
+    bool found = false;
+    for (i = 0; i < fn_entries; ++i) {
+        if (fn_table[i].fn == fn) {
+            if (!fn_table[i].thread_safe) return false;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool ExprIsThreadSafe(const Expr* e) {
+    if (!IsThreadSafe(e->fn)) return false;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (!ExprIsThreadSafe(e->argv[i])) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const State* parent;
+    int argc;
+    Expr** argv;
+    Value** results;
+    char** errors;
+    pthread_mutex_t lock;
+    int next;
+} ParallelJob;
+
+static void* ParallelWorker(void* cookie) {
+    ParallelJob* job = (ParallelJob*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->argc) break;
+
+        // Each argument gets its own State so errors don't collide.
+        State state = *job->parent;
+        state.errmsg = NULL;
+        job->results[i] = EvaluateValue(&state, job->argv[i]);
+        if (job->results[i] == NULL) {
+            job->errors[i] = state.errmsg;
+        } else {
+            free(state.errmsg);
+        }
+    }
+    return NULL;
+}
+
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return StringValue(strdup(""));
+    }
+
+    ParallelJob job;
+    job.parent = state;
+    job.argc = argc;
+    job.argv = argv;
+    job.results = calloc(argc, sizeof(Value*));
+    job.errors = calloc(argc, sizeof(char*));
+    pthread_mutex_init(&job.lock, NULL);
+    job.next = 0;
+
+    int threads = 1;
+    int i;
+    bool safe = true;
+    for (i = 0; i < argc && safe; ++i) {
+        safe = ExprIsThreadSafe(argv[i]);
+    }
+    if (safe) {
+        // Not limited to the number of CPUs: the point is mostly to
+        // overlap I/O to different devices.
+        threads = argc < PARALLEL_MAX_THREADS ? argc : PARALLEL_MAX_THREADS;
+    } else {
+        fprintf(stderr, "%s: not all arguments are thread-safe; "
+                "running them in order\n", name);
+    }
+
+    // The calling thread is one of the workers.
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (i = 1; i < threads; ++i) {
+        if (pthread_create(&workers[started], NULL, ParallelWorker, &job) != 0) {
+            break;
+        }
+        ++started;
+    }
+    ParallelWorker(&job);
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+
+    // Report every argument that failed, not just the first.
+    Value* result = NULL;
+    size_t errlen = 0;
+    for (i = 0; i < argc; ++i) {
+        if (job.results[i] == NULL) {
+            errlen += 64 + (job.errors[i] ? strlen(job.errors[i]) : 0);
+        }
+    }
+    if (errlen > 0) {
+        char* errmsg = malloc(errlen);
+        size_t pos = 0;
+        for (i = 0; i < argc; ++i) {
+            if (job.results[i] != NULL) continue;
+            pos += sprintf(errmsg + pos, "%s%s() argument %d: %s",
+                           pos > 0 ? "\n" : "", name, i + 1,
+                           job.errors[i] ? job.errors[i] : "(no error message)");
+        }
+        free(state->errmsg);
+        state->errmsg = errmsg;
+    } else {
+        result = job.results[argc-1];
+        job.results[argc-1] = NULL;
+    }
+    for (i = 0; i < argc; ++i) {
+        FreeValue(job.results[i]);
+        free(job.errors[i]);
+    }
+    free(job.results);
+    free(job.errors);
+    return result;
+}
+
 // -----------------------------------------------------------------
 //   convenience methods for functions
 // -----------------------------------------------------------------
@@ -403,25 +565,27 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            // Free the ones already handed out.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                char** out = va_arg(v, char**);
+                free(*out);
+                *out = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +593,28 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            // Free the ones already handed out.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                Value** out = va_arg(v, Value**);
+                FreeValue(*out);
+                *out = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        LoadValue(arg);
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -489,6 +656,7 @@ Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]) {
             free(args);
             return NULL;
         }
+        LoadValue(args[i]);
     }
     return args;
 }
@@ -17,6 +17,8 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -28,6 +30,7 @@ extern "C" {
 #define MAX_STRING_LEN 1024
 
 typedef struct Expr Expr;
+typedef struct Program Program;
 
 typedef struct {
     // Optional pointer to app-specific data; the core of edify never
@@ -48,11 +51,41 @@ typedef struct {
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
 #define VAL_BLOB    2
 
+typedef struct Value Value;
+
+// Where a blob's bytes live when they aren't a malloc'd buffer owned
+// by the Value, eg. a file in the package: either borrowed straight
+// from the package mapping, or inflated only when first needed.
 typedef struct {
+    // Fill in data (leaving size unchanged), or set size to -1 if
+    // that fails.  NULL if data is always present.
+    void (*load)(Value* v);
+    // Called by FreeValue() in place of free(data).  The Value itself
+    // is still freed with free(), so it must be at the start of its
+    // allocation.
+    void (*release)(Value* v);
+} ValueBacking;
+
+struct Value {
     int type;
     ssize_t size;
     char* data;
-} Value;
+    // NULL for Values that own data.  Otherwise data is read-only, and
+    // may be NULL until LoadValue() is called.
+    const ValueBacking* backing;
+};
+
+// Make sure v->data is present, loading it if it isn't yet.  On
+// failure v->size is set to -1 and v->data stays NULL, just as for a
+// blob that couldn't be read in the first place.  ReadValueArgs() and
+// ReadValueVarArgs() load every Value they return; only callers of
+// EvaluateValue() need this.
+static inline void LoadValue(Value* v) {
+    if (v->backing != NULL && v->backing->load != NULL &&
+        v->data == NULL && v->size > 0) {
+        v->backing->load(v);
+    }
+}
 
 typedef Value* (*Function)(const char* name, State* state,
                            int argc, Expr* argv[]);
@@ -63,6 +96,9 @@ struct Expr {
     int argc;
     Expr** argv;
     int start, end;
+    // Bytecode for this subtree, set by CompileExpr(); NULL if the
+    // subtree is evaluated by calling fn.
+    Program* code;
 };
 
 // Take one of the Expr*s passed to the function as an argument,
@@ -96,11 +132,44 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Fold the constant parts of a parsed script and compile its operators
+// to bytecode, in place.  Call once after a successful parse, before
+// evaluating.  Evaluating the tree gives the same results, errors and
+// side effects as before, and Functions are called exactly as before.
+void CompileExpr(Expr* root);
+
+// Run the bytecode CompileExpr() attached to an Expr.
+Value* RunProgram(State* state, Program* prog);
+
+// Per-call-site profiling.  While enabled, every function call records
+// its wall and CPU time, the process's I/O (from /proc/self/io) and
+// heap growth against the Expr it was made from.  Disabled (the
+// default), it costs a test of gProfileCalls per call.
+void SetProfiling(bool enabled);
+
+// Write the calls recorded so far, slowest call site first: a table to
+// log and, if json_path isn't NULL, the same numbers as a JSON array.
+// Call sites are identified by function name and script line.
+void WriteProfile(FILE* log, const char* json_path);
+
+// Used by the evaluator to dispatch a call while profiling is on.
+extern bool gProfileCalls;
+Value* ProfileCall(State* state, Expr* e);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]);
 
+// parallel(expr, ...) evaluates its arguments concurrently on a pool
+// of threads and waits for all of them.  If every argument succeeds it
+// returns the value of the last one; otherwise it fails with the
+// errors of all the arguments that failed, one per line.  Arguments
+// are only run concurrently if every function they can call was
+// registered with RegisterThreadSafeFunction(); if not, they run one
+// after another on the calling thread.
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]);
+
 
 // For setting and getting the global error string (when returning
 // NULL from a function).
@@ -112,12 +181,19 @@ void ClearError();
 typedef struct {
   const char* name;
   Function fn;
+  bool thread_safe;
 } NamedFunction;
 
 // Register a new function.  The same Function may be registered under
 // multiple names, but a given name should only be used once.
 void RegisterFunction(const char* name, Function fn);
 
+// Register a function that may be called on several threads at once
+// (by parallel()).  It must not use unlocked global state, and its
+// only use of State should be through its own state argument, which is
+// private to the calling thread.
+void RegisterThreadSafeFunction(const char* name, Function fn);
+
 // Register all the builtins.
 void RegisterBuiltins();
 
@@ -23,13 +23,12 @@
 
 extern int yyparse(Expr** root, int* error_count);
 
-int expect(const char* expr_str, const char* expected, int* errors) {
+static int expect_once(const char* expr_str, const char* expected,
+                       int* errors, int compile) {
     Expr* e;
     int error;
     char* result;
 
-    printf(".");
-
     yy_scan_string(expr_str);
     int error_count = 0;
     error = yyparse(&e, &error_count);
@@ -39,6 +38,9 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         ++*errors;
         return 0;
     }
+    if (compile) {
+        CompileExpr(e);
+    }
 
     State state;
     state.cookie = NULL;
@@ -49,7 +51,8 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     free(state.errmsg);
     free(state.script);
     if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
+        fprintf(stderr, "error evaluating \"%s\"%s\n", expr_str,
+                compile ? " (compiled)" : "");
         ++*errors;
         return 0;
     }
@@ -58,9 +61,10 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         return 1;
     }
 
-    if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
+    if (expected == NULL || strcmp(result, expected) != 0) {
+        fprintf(stderr, "evaluating \"%s\"%s: expected \"%s\", got \"%s\"\n",
+                expr_str, compile ? " (compiled)" : "",
+                expected == NULL ? "(NULL)" : expected, result);
         ++*errors;
         free(result);
         return 0;
@@ -70,6 +74,13 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     return 1;
 }
 
+// Check the script both as parsed and after CompileExpr().
+int expect(const char* expr_str, const char* expected, int* errors) {
+    printf(".");
+    return expect_once(expr_str, expected, errors, 0) &
+           expect_once(expr_str, expected, errors, 1);
+}
+
 int test() {
     int errors = 0;
 
@@ -154,6 +165,36 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // constant folding mustn't change what runs, or in what order
+    expect("concat()", "", &errors);
+    expect("concat(a + b, c) + d", "abcd", &errors);
+    expect("if a + b == ab then yes else no endif", "yes", &errors);
+    expect("if a == b then abort() else no endif", "no", &errors);
+    expect("if a != b then abort() else no endif", NULL, &errors);
+    expect("\"\" && abort(); c", "c", &errors);
+    expect("a; b; abort(); c", NULL, &errors);
+    expect("ifelse(\"\", abort())", "", &errors);
+    expect("concat(a, abort(), b)", NULL, &errors);
+    expect("is_substring(b, a + b + c) && !(x == y)", "t", &errors);
+    expect("less_than_int(1 + 0, 20) || abort()", "t", &errors);
+    expect("assert(a + b == ab, t && \"\")", NULL, &errors);
+    expect("a + less_than_int(1, 2) + b", "atb", &errors);
+
+    // parallel function
+    expect("parallel()", "", &errors);
+    expect("parallel(a, b + c, d)", "d", &errors);
+    expect("parallel(a, abort(), c)", NULL, &errors);
+    expect("parallel(a, b); c", "c", &errors);
+    expect("parallel(parallel(a, b), concat(c, d))", "cd", &errors);
+
+    // profiling doesn't change results
+    SetProfiling(true);
+    expect("concat(a, less_than_int(1, 2)) + b", "atb", &errors);
+    expect("ifelse(is_substring(a, b), abort(), c)", "c", &errors);
+    expect("a; b; abort(); c", NULL, &errors);
+    expect("parallel(concat(a, b), concat(c, d))", "cd", &errors);
+    SetProfiling(false);
+
     printf("\n");
 
     return errors;
@@ -199,6 +240,9 @@ int main(int argc, char** argv) {
     if (error == 0 || error_count > 0) {
 
         ExprDump(0, root, buffer);
+        if (error == 0 && error_count == 0) {
+            CompileExpr(root);
+        }
 
         State state;
         state.cookie = NULL;
@@ -73,6 +73,7 @@ expr:  STRING {
     $$->argv = NULL;
     $$->start = @$.start;
     $$->end = @$.end;
+    $$->code = NULL;
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
@@ -100,6 +101,7 @@ expr:  STRING {
     $$->argv = $3.argv;
     $$->start = @$.start;
     $$->end = @$.end;
+    $$->code = NULL;
 }
 ;
 
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "expr.h"
+
+// Per-call-site profiling of edify function calls.  Both places that
+// call a Function (EvaluateValue() and the bytecode interpreter) test
+// gProfileCalls and go through ProfileCall() only when it's set, so a
+// disabled profiler costs one load and branch per call.
+//
+// Times are inclusive: a function's arguments are evaluated inside the
+// function, so their calls are counted again in the caller.  "self"
+// time subtracts the wall time of calls made directly underneath.  I/O
+// counters (/proc/self/io) and heap use (mallinfo(), or mallinfo2() on
+// glibc) are per process, so inside parallel() they include whatever
+// the other threads did at the same time.
+
+bool gProfileCalls = false;
+
+typedef struct {
+    uint64_t rchar;         // bytes passed to read()-like calls
+    uint64_t wchar;         // bytes passed to write()-like calls
+    uint64_t read_bytes;    // bytes fetched from storage
+    uint64_t write_bytes;   // bytes sent to storage
+} IoCounters;
+
+typedef struct {
+    const Expr* expr;
+    const char* script;
+    uint64_t calls;
+    int64_t wall_ns;
+    int64_t self_ns;
+    int64_t cpu_ns;
+    IoCounters io;
+    int64_t heap_bytes;     // net growth of the heap
+} CallSite;
+
+// The call in progress on a thread, for working out self time.
+typedef struct Frame {
+    struct Frame* parent;
+    int64_t child_ns;
+} Frame;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static CallSite* sites = NULL;     // open-addressed by Expr*
+static int sites_size = 0;         // power of two
+static int sites_count = 0;
+static int io_fd = -1;
+// Bytes read from /proc/self/io by the profiler itself, which show up
+// in rchar and are subtracted again.
+static volatile uint64_t io_overhead = 0;
+
+static pthread_key_t frame_key;
+static pthread_once_t frame_once = PTHREAD_ONCE_INIT;
+
+static void create_frame_key() {
+    pthread_key_create(&frame_key, NULL);
+}
+
+static int64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t io_field(const char* buf, const char* key) {
+    const char* p = strstr(buf, key);
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+static void read_io(IoCounters* io) {
+    memset(io, 0, sizeof(*io));
+    if (io_fd < 0) return;
+    char buf[512];
+    ssize_t n = pread(io_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return;
+    buf[n] = '\0';
+    // The text we just read was generated before this read counted.
+    uint64_t overhead = __sync_fetch_and_add(&io_overhead, n);
+    io->rchar = io_field(buf, "rchar: ") - overhead;
+    io->wchar = io_field(buf, "wchar: ");
+    io->read_bytes = io_field(buf, "\nread_bytes: ");
+    io->write_bytes = io_field(buf, "\nwrite_bytes: ");
+}
+
+static int64_t heap_in_use() {
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // glibc's mallinfo() is deprecated and its int fields wrap at 2 GB.
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+    return mi.uordblks;
+}
+
+static unsigned int hash_expr(const Expr* e) {
+    uintptr_t p = (uintptr_t)e;
+    return (unsigned int)((p >> 3) ^ (p >> 17)) * 2654435761u;
+}
+
+// Caller holds profile_lock.
+static CallSite* find_site(const Expr* e) {
+    if ((sites_count + 1) * 2 > sites_size) {
+        CallSite* old = sites;
+        int old_size = sites_size;
+        sites_size = old_size ? old_size * 2 : 256;
+        sites = calloc(sites_size, sizeof(CallSite));
+        int i;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].expr == NULL) continue;
+            unsigned int j = hash_expr(old[i].expr) & (sites_size - 1);
+            while (sites[j].expr != NULL) j = (j + 1) & (sites_size - 1);
+            sites[j] = old[i];
+        }
+        free(old);
+    }
+    unsigned int i = hash_expr(e) & (sites_size - 1);
+    while (sites[i].expr != NULL && sites[i].expr != e) {
+        i = (i + 1) & (sites_size - 1);
+    }
+    if (sites[i].expr == NULL) {
+        sites[i].expr = e;
+        ++sites_count;
+    }
+    return sites + i;
+}
+
+void SetProfiling(bool enabled) {
+    pthread_mutex_lock(&profile_lock);
+    if (enabled && io_fd < 0) {
+        io_fd = open("/proc/self/io", O_RDONLY);
+    }
+    gProfileCalls = enabled;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+Value* ProfileCall(State* state, Expr* e) {
+    // Literals and the parser's operators aren't call sites.
+    if (e->fn == Literal || strcmp(e->name, "(operator)") == 0) {
+        return e->fn(e->name, state, e->argc, e->argv);
+    }
+
+    pthread_once(&frame_once, create_frame_key);
+    Frame frame;
+    frame.parent = pthread_getspecific(frame_key);
+    frame.child_ns = 0;
+    pthread_setspecific(frame_key, &frame);
+
+    IoCounters io0, io1;
+    read_io(&io0);
+    int64_t heap0 = heap_in_use();
+    int64_t cpu0 = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    int64_t wall0 = now_ns(CLOCK_MONOTONIC);
+
+    Value* v = e->fn(e->name, state, e->argc, e->argv);
+
+    int64_t wall = now_ns(CLOCK_MONOTONIC) - wall0;
+    int64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    int64_t heap = heap_in_use() - heap0;
+    read_io(&io1);
+
+    pthread_setspecific(frame_key, frame.parent);
+    if (frame.parent != NULL) frame.parent->child_ns += wall;
+
+    pthread_mutex_lock(&profile_lock);
+    CallSite* site = find_site(e);
+    site->script = state->script;
+    site->calls++;
+    site->wall_ns += wall;
+    site->self_ns += wall - frame.child_ns;
+    site->cpu_ns += cpu;
+    site->io.rchar += io1.rchar - io0.rchar;
+    site->io.wchar += io1.wchar - io0.wchar;
+    site->io.read_bytes += io1.read_bytes - io0.read_bytes;
+    site->io.write_bytes += io1.write_bytes - io0.write_bytes;
+    site->heap_bytes += heap;
+    pthread_mutex_unlock(&profile_lock);
+
+    return v;
+}
+
+static int line_of(const CallSite* s) {
+    if (s->script == NULL) return 0;
+    int line = 1;
+    const char* p;
+    const char* end = s->script + s->expr->start;
+    for (p = s->script; p < end && *p; ++p) {
+        if (*p == '\n') ++line;
+    }
+    return line;
+}
+
+static int compare_wall(const void* a, const void* b) {
+    const CallSite* sa = *(const CallSite* const*)a;
+    const CallSite* sb = *(const CallSite* const*)b;
+    if (sa->wall_ns != sb->wall_ns) return sa->wall_ns < sb->wall_ns ? 1 : -1;
+    return sa->expr->start - sb->expr->start;
+}
+
+static void write_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+#define MS(ns) ((ns) / 1000000.0)
+
+void WriteProfile(FILE* log, const char* json_path) {
+    pthread_mutex_lock(&profile_lock);
+
+    CallSite** sorted = malloc(sites_count * sizeof(CallSite*));
+    int n = 0;
+    int i;
+    for (i = 0; i < sites_size; ++i) {
+        if (sites[i].expr != NULL) sorted[n++] = sites + i;
+    }
+    qsort(sorted, n, sizeof(CallSite*), compare_wall);
+
+    if (log != NULL) {
+        fprintf(log, "edify profile (%d call sites, by wall time):\n", n);
+        fprintf(log, "%6s %-24s %7s %10s %10s %10s %10s %10s %10s\n",
+                "line", "function", "calls", "wall_ms", "self_ms", "cpu_ms",
+                "read_kb", "write_kb", "heap_kb");
+        for (i = 0; i < n; ++i) {
+            const CallSite* s = sorted[i];
+            fprintf(log, "%6d %-24s %7llu %10.1f %10.1f %10.1f %10llu %10llu %10lld\n",
+                    line_of(s), s->expr->name, (unsigned long long)s->calls,
+                    MS(s->wall_ns), MS(s->self_ns), MS(s->cpu_ns),
+                    (unsigned long long)(s->io.rchar / 1024),
+                    (unsigned long long)(s->io.wchar / 1024),
+                    (long long)(s->heap_bytes / 1024));
+        }
+    }
+
+    FILE* f = json_path ? fopen(json_path, "w") : NULL;
+    if (json_path != NULL && f == NULL) {
+        if (log != NULL) fprintf(log, "can't write %s\n", json_path);
+    }
+    if (f != NULL) {
+        fprintf(f, "[\n");
+        for (i = 0; i < n; ++i) {
+            const CallSite* s = sorted[i];
+            fprintf(f, "  {\"line\": %d, \"start\": %d, \"end\": %d, \"function\": ",
+                    line_of(s), s->expr->start, s->expr->end);
+            write_json_string(f, s->expr->name);
+            fprintf(f, ", \"calls\": %llu, \"wall_ms\": %.3f, \"self_ms\": %.3f, "
+                    "\"cpu_ms\": %.3f, \"rchar\": %llu, \"wchar\": %llu, "
+                    "\"read_bytes\": %llu, \"write_bytes\": %llu, "
+                    "\"heap_bytes\": %lld}%s\n",
+                    (unsigned long long)s->calls,
+                    MS(s->wall_ns), MS(s->self_ns), MS(s->cpu_ns),
+                    (unsigned long long)s->io.rchar,
+                    (unsigned long long)s->io.wchar,
+                    (unsigned long long)s->io.read_bytes,
+                    (unsigned long long)s->io.write_bytes,
+                    (long long)s->heap_bytes,
+                    i + 1 < n ? "," : "");
+        }
+        fprintf(f, "]\n");
+        fclose(f);
+    }
+
+    free(sorted);
+    pthread_mutex_unlock(&profile_lock);
+}
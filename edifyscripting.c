@@ -287,6 +287,9 @@ static int run_script_from_buffer(char* script_data, int script_len, char* filen
     printf("parse returned %d; %d errors encountered\n", error, error_count);
     if (error == 0 || error_count > 0) {
         //ExprDump(0, root, buffer);
+        if (error == 0 && error_count == 0) {
+            CompileExpr(root);
+        }
 
         State state;
         state.cookie = NULL;
@@ -341,6 +344,9 @@ int edify_main(int argc, char** argv) {
     if (error == 0 || error_count > 0) {
 
         //ExprDump(0, root, buffer);
+        if (error == 0 && error_count == 0) {
+            CompileExpr(root);
+        }
 
         State state;
         state.cookie = NULL;
@@ -38,6 +38,9 @@ extern int cmd_bml_get_partition_device(const char *partition, char *device);
 
 extern int device_flash_type();
 extern int get_flash_type(const char* fs_type);
+// The flash type (MTD, MMC, BML) of a partition name or device path,
+// or of partitionType if that isn't NULL.
+extern int detect_partition(const char *partitionType, const char *partition);
 
 enum flash_type {
     UNSUPPORTED = -1,
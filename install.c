@@ -16,14 +16,21 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "cutils/properties.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
 #include "minui/minui.h"
@@ -34,6 +41,7 @@
 #include "roots.h"
 #include "verifier.h"
 #include "recovery_ui.h"
+#include "ui_channel.h"
 
 #include "firmware.h"
 
@@ -145,15 +153,12 @@ static int unset_legacy_props() {
     return 0;
 }
 
-// If the package contains an update binary, extract it and run it.
-static int
-try_update_binary(const char *path, ZipArchive *zip) {
-#ifdef BOARD_NATIVE_DUALBOOT_SINGLEDATA
-	int rc;
-	if((rc=device_truedualboot_before_update(path, zip))!=0)
-		return rc;
-#endif
+static const char* UPDATE_BINARY_PATH = "/tmp/update_binary";
 
+// Extract the package's update binary to UPDATE_BINARY_PATH.  This only
+// stages it; nothing from the package is run until try_update_binary().
+static int
+stage_update_binary(ZipArchive *zip) {
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
     if (binary_entry == NULL) {
@@ -164,29 +169,362 @@ try_update_binary(const char *path, ZipArchive *zip) {
             ui_print("Amend scripting was deprecated by Google in Android 1.5.\n");
             ui_print("It was necessary to remove it when upgrading to the ClockworkMod 3.0 Gingerbread based recovery.\n");
             ui_print("Please switch to Edify scripting (updater-script and update-binary) to create working update zip packages.\n");
-            return INSTALL_UPDATE_BINARY_MISSING;
         }
-
-        mzCloseZipArchive(zip);
         return INSTALL_UPDATE_BINARY_MISSING;
     }
 
-    char* binary = "/tmp/update_binary";
-    unlink(binary);
-    int fd = creat(binary, 0755);
+    unlink(UPDATE_BINARY_PATH);
+    int fd = creat(UPDATE_BINARY_PATH, 0755);
     if (fd < 0) {
-        mzCloseZipArchive(zip);
-        LOGE("Can't make %s\n", binary);
-        return 1;
+        LOGE("Can't make %s\n", UPDATE_BINARY_PATH);
+        return INSTALL_ERROR;
     }
     bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
     close(fd);
 
     if (!ok) {
         LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-        mzCloseZipArchive(zip);
-        return 1;
+        unlink(UPDATE_BINARY_PATH);
+        return INSTALL_ERROR;
+    }
+    return INSTALL_SUCCESS;
+}
+
+// Which of the edify builtins that tell updater generations apart are
+// named in an update-binary.
+#define UPDATER_HAS_SET_PERM      0x1
+#define UPDATER_HAS_SET_METADATA  0x2
+
+// Look for the builtin names in [data, data+len).  Both start with "set_",
+// so only the bytes after each "set_" need comparing.
+static int
+scan_for_builtins(const unsigned char* data, size_t len, int found) {
+    static const char set_perm[] = "perm_";
+    static const char set_metadata[] = "metadata_";
+    const size_t prefix = 4;    // strlen("set_")
+
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    while (found != (UPDATER_HAS_SET_PERM | UPDATER_HAS_SET_METADATA) &&
+           (size_t)(end - p) > prefix) {
+        p = memchr(p, 's', end - p - prefix);
+        if (p == NULL) break;
+        if (memcmp(p, "set_", prefix) != 0) {
+            ++p;
+            continue;
+        }
+        const unsigned char* rest = p + prefix;
+        size_t avail = end - rest;
+        if (avail >= sizeof(set_perm) - 1 &&
+            memcmp(rest, set_perm, sizeof(set_perm) - 1) == 0) {
+            found |= UPDATER_HAS_SET_PERM;
+        } else if (avail >= sizeof(set_metadata) - 1 &&
+                   memcmp(rest, set_metadata, sizeof(set_metadata) - 1) == 0) {
+            found |= UPDATER_HAS_SET_METADATA;
+        }
+        p = rest;
+    }
+    return found;
+}
+
+// The builtin names are string literals handed to RegisterFunction(), so
+// they live in read-only data (or the dynamic string table, for an
+// updater that exports them).  Scan only the ELF sections that can hold
+// them.  Returns -1 if the section headers can't be used, in which case
+// the caller scans the whole file.
+#define DEFINE_SCAN_ELF_SECTIONS(bits)                                        \
+static int                                                                    \
+scan_elf##bits##_sections(const unsigned char* data, size_t len) {            \
+    const Elf##bits##_Ehdr* eh = (const Elf##bits##_Ehdr*)data;               \
+    if (len < sizeof(*eh) || eh->e_shoff == 0 || eh->e_shnum == 0 ||          \
+        eh->e_shentsize != sizeof(Elf##bits##_Shdr) ||                        \
+        eh->e_shoff > len ||                                                  \
+        (len - eh->e_shoff) / sizeof(Elf##bits##_Shdr) < eh->e_shnum) {       \
+        return -1;                                                            \
+    }                                                                         \
+    const Elf##bits##_Shdr* sh =                                              \
+            (const Elf##bits##_Shdr*)(data + eh->e_shoff);                    \
+    int found = 0;                                                            \
+    int i;                                                                    \
+    for (i = 0; i < eh->e_shnum; ++i) {                                       \
+        if (sh[i].sh_type != SHT_PROGBITS && sh[i].sh_type != SHT_STRTAB) {   \
+            continue;                                                         \
+        }                                                                     \
+        if (sh[i].sh_flags & (SHF_EXECINSTR | SHF_WRITE)) continue;           \
+        if (sh[i].sh_offset > len || sh[i].sh_size > len - sh[i].sh_offset) { \
+            return -1;                                                        \
+        }                                                                     \
+        found = scan_for_builtins(data + sh[i].sh_offset, sh[i].sh_size,      \
+                                  found);                                     \
+    }                                                                         \
+    return found;                                                             \
+}
+
+DEFINE_SCAN_ELF_SECTIONS(32)
+DEFINE_SCAN_ELF_SECTIONS(64)
+
+// Returns a mask of UPDATER_HAS_* for the binary at path, or -1 if it
+// can't be read.
+static int
+scan_update_binary(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const unsigned char* data =
+            mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOGE("Can't map %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    size_t len = st.st_size;
+
+    int found = -1;
+    if (len >= EI_NIDENT && memcmp(data, ELFMAG, SELFMAG) == 0) {
+        if (data[EI_CLASS] == ELFCLASS32) {
+            found = scan_elf32_sections(data, len);
+        } else if (data[EI_CLASS] == ELFCLASS64) {
+            found = scan_elf64_sections(data, len);
+        }
+    }
+    if (found < 0) {
+        // Not ELF, or the section headers are stripped or damaged.
+        found = scan_for_builtins(data, len, 0);
+    }
+
+    munmap((void*)data, len);
+    return found;
+}
+
+// Scan results for update-binaries seen before, keyed by the CRC and size
+// from the package's central directory.  Extraction already checked the
+// staged file against that CRC, so a match means the same binary.
+typedef struct {
+    bool valid;
+    long crc32;
+    long size;
+    int compat;
+} UpdaterCompat;
+
+#define UPDATER_COMPAT_CACHE_SIZE 4
+
+static UpdaterCompat updater_compat_cache[UPDATER_COMPAT_CACHE_SIZE];
+static int updater_compat_next = 0;
+
+static int
+updater_compat_cached(ZipArchive* zip) {
+    const ZipEntry* entry = mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
+    if (entry == NULL) return -1;
+    int i;
+    for (i = 0; i < UPDATER_COMPAT_CACHE_SIZE; ++i) {
+        const UpdaterCompat* c = updater_compat_cache + i;
+        if (c->valid && c->crc32 == mzGetZipEntryCrc32(entry) &&
+            c->size == mzGetZipEntryUncompLen(entry)) {
+            return c->compat;
+        }
+    }
+    return -1;
+}
+
+static void
+updater_compat_remember(ZipArchive* zip, int compat) {
+    const ZipEntry* entry = mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
+    if (entry == NULL) return;
+    UpdaterCompat* c = updater_compat_cache + updater_compat_next;
+    c->valid = true;
+    c->crc32 = mzGetZipEntryCrc32(entry);
+    c->size = mzGetZipEntryUncompLen(entry);
+    c->compat = compat;
+    updater_compat_next = (updater_compat_next + 1) % UPDATER_COMPAT_CACHE_SIZE;
+}
+
+// Act on one line of the text protocol from the update binary.
+static void
+handle_updater_command(char* buffer,
+                       char** firmware_type, char** firmware_filename) {
+    char* command = strtok(buffer, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+
+        float fraction = strtof(fraction_s, NULL);
+        int seconds = strtol(seconds_s, NULL, 10);
+
+        ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                         seconds);
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        float fraction = strtof(fraction_s, NULL);
+        ui_set_progress(fraction);
+    } else if (strcmp(command, "firmware") == 0) {
+        char* type = strtok(NULL, " \n");
+        char* filename = strtok(NULL, " \n");
+
+        if (type != NULL && filename != NULL) {
+            if (*firmware_type != NULL) {
+                LOGE("ignoring attempt to do multiple firmware updates");
+            } else {
+                *firmware_type = strdup(type);
+                *firmware_filename = strdup(filename);
+            }
+        }
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        if (str) {
+            ui_print("%s", str);
+        } else {
+            ui_print("\n");
+        }
+    } else {
+        LOGE("unknown command [%s]\n", command);
+    }
+}
+
+// Apply everything the update binary has queued in the v4 channel.  Runs
+// of set_progress collapse to the last one, and all the text is printed
+// with a single redraw.
+static void
+drain_ui_channel(UiChannel* channel) {
+    static char text[16384];
+    size_t text_len = 0;
+    float pending_fraction = -1;
+    unsigned char payload[UI_RECORD_MAX_PAYLOAD];
+    int type;
+    size_t len;
+
+    while (ui_channel_read(channel, &type, payload, &len)) {
+        switch (type) {
+            case UI_RECORD_PROGRESS: {
+                UiProgressRecord rec;
+                if (len != sizeof(rec)) break;
+                memcpy(&rec, payload, sizeof(rec));
+                if (pending_fraction >= 0) {
+                    ui_set_progress(pending_fraction);
+                    pending_fraction = -1;
+                }
+                ui_show_progress(rec.fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                                 rec.seconds);
+                break;
+            }
+            case UI_RECORD_SET_PROGRESS:
+                if (len != sizeof(float)) break;
+                memcpy(&pending_fraction, payload, sizeof(float));
+                break;
+            case UI_RECORD_PRINT:
+                if (text_len + len >= sizeof(text)) {
+                    text[text_len] = '\0';
+                    ui_print_text(text);
+                    text_len = 0;
+                }
+                memcpy(text + text_len, payload, len);
+                text_len += len;
+                break;
+            case UI_RECORD_TIMING: {
+                uint32_t msec;
+                if (len < sizeof(msec)) break;
+                memcpy(&msec, payload, sizeof(msec));
+                LOGI("updater: %.*s took %u ms\n", (int)(len - sizeof(msec)),
+                     (const char*)payload + sizeof(msec), msec);
+                break;
+            }
+            default:
+                LOGE("unknown ui channel record %d\n", type);
+                break;
+        }
+    }
+    if (pending_fraction >= 0) ui_set_progress(pending_fraction);
+    if (text_len > 0) {
+        text[text_len] = '\0';
+        ui_print_text(text);
     }
+}
+
+static long long
+now_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Read the command pipe until the update binary closes it, draining the
+// v4 channel once per frame in between.
+static void
+read_updater_output(int fd, UiChannel* channel,
+                    char** firmware_type, char** firmware_filename) {
+    char buffer[1024];
+    size_t used = 0;
+    int fps = ui_get_update_fps();
+    long long interval = 1000 / (fps > 0 ? fps : 30);
+    long long next_drain = now_msec() + interval;
+
+    for (;;) {
+        long long wait = next_drain - now_msec();
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int n = poll(&pfd, 1, wait > 0 ? (int)wait : 0);
+        if (n > 0) {
+            ssize_t r = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            used += r;
+
+            // Hand over each complete line.  Like fgets(), split lines
+            // that don't fit in the buffer.
+            char* start = buffer;
+            char* nl;
+            while ((nl = memchr(start, '\n', buffer + used - start)) != NULL) {
+                *nl = '\0';
+                handle_updater_command(start, firmware_type, firmware_filename);
+                start = nl + 1;
+            }
+            used -= start - buffer;
+            memmove(buffer, start, used);
+            if (used == sizeof(buffer) - 1) {
+                buffer[used] = '\0';
+                handle_updater_command(buffer, firmware_type, firmware_filename);
+                used = 0;
+            }
+        } else if (n < 0 && errno != EINTR) {
+            LOGE("poll on updater pipe failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        if (now_msec() >= next_drain) {
+            drain_ui_channel(channel);
+            next_drain = now_msec() + interval;
+        }
+    }
+    if (used > 0) {
+        buffer[used] = '\0';
+        handle_updater_command(buffer, firmware_type, firmware_filename);
+    }
+    drain_ui_channel(channel);
+}
+
+// Run the update binary staged by stage_update_binary().
+static int
+try_update_binary(const char *path, ZipArchive *zip) {
+#ifdef BOARD_NATIVE_DUALBOOT_SINGLEDATA
+	int rc;
+	if((rc=device_truedualboot_before_update(path, zip))!=0)
+		return rc;
+#endif
+
+    char* binary = (char*)UPDATE_BINARY_PATH;
 
     /* Make sure the update binary is compatible with this recovery
      *
@@ -194,45 +532,19 @@ try_update_binary(const char *path, ZipArchive *zip) {
      * has a different property namespace structure. If "set_perm_"
      * is found, it's probably a regular updater instead of a custom
      * one. If "set_metadata_" isn't there, it's pre-4.4, which
-     * makes it incompatible.
-     *
-     * Also, I hate matching strings in binary blobs */
-
-    FILE *updaterfile = fopen(binary, "rb");
-    char tmpbuf;
-    char setpermmatch[9] = { 's','e','t','_','p','e','r','m','_' };
-    char setmetamatch[13] = { 's','e','t','_','m','e','t','a','d','a','t','a','_' };
-    size_t pos = 0;
-    bool foundsetperm = false;
-    bool foundsetmeta = false;
-
-    if (updaterfile == NULL) {
-        LOGE("Can't find %s for validation\n", ASSUMED_UPDATE_BINARY_NAME);
-        return 1;
-    }
-    fseek(updaterfile, 0, SEEK_SET);
-    while (!feof(updaterfile)) {
-        fread(&tmpbuf, 1, 1, updaterfile);
-        if (!foundsetperm && pos < sizeof(setpermmatch) && tmpbuf == setpermmatch[pos]) {
-            pos++;
-            if (pos == sizeof(setpermmatch)) {
-                foundsetperm = true;
-                pos = 0;
-            }
-            continue;
+     * makes it incompatible. */
+
+    int compat = updater_compat_cached(zip);
+    if (compat < 0) {
+        compat = scan_update_binary(binary);
+        if (compat < 0) {
+            LOGE("Can't find %s for validation\n", ASSUMED_UPDATE_BINARY_NAME);
+            return 1;
         }
-        if (!foundsetmeta && tmpbuf == setmetamatch[pos]) {
-            pos++;
-            if (pos == sizeof(setmetamatch)) {
-                foundsetmeta = true;
-                pos = 0;
-            }
-            continue;
-        }
-        /* None of the match loops got a continuation, reset the counter */
-        pos = 0;
+        updater_compat_remember(zip, compat);
     }
-    fclose(updaterfile);
+    bool foundsetperm = (compat & UPDATER_HAS_SET_PERM) != 0;
+    bool foundsetmeta = (compat & UPDATER_HAS_SET_METADATA) != 0;
 
     /* Set legacy properties */
     if (foundsetperm && !foundsetmeta) {
@@ -247,6 +559,15 @@ try_update_binary(const char *path, ZipArchive *zip) {
     int pipefd[2];
     pipe(pipefd);
 
+    // Offer the v4 channel; binaries that don't know about it just
+    // ignore the environment variable.
+    int channel_fd = -1;
+    UiChannel* channel = ui_channel_create(&channel_fd);
+    if (channel == NULL) {
+        LOGW("can't create ui channel (%s); using text protocol only\n",
+             strerror(errno));
+    }
+
     // When executing the update binary contained in the package, the
     // arguments passed are:
     //
@@ -280,6 +601,11 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //
     //   - the name of the package zip file.
     //
+    // If UI_CHANNEL_ENV is set in its environment, the binary may send
+    // progress, set_progress and ui_print as records through the shared
+    // memory channel named there instead (see ui_channel.h).  The pipe
+    // still carries all other commands.
+    //
 
     char** args = malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -292,59 +618,46 @@ try_update_binary(const char *path, ZipArchive *zip) {
     pid_t pid = fork();
     if (pid == 0) {
         setenv("UPDATE_PACKAGE", path, 1);
+        // "setprop recovery.updater_profile 1" (or a path for the JSON
+        // output) before an install profiles the script's function
+        // calls; see UPDATER_PROFILE_ENV in updater/updater.c.
+        char profile[PROPERTY_VALUE_MAX];
+        if (property_get("recovery.updater_profile", profile, "") > 0) {
+            setenv("UPDATER_PROFILE", profile, 1);
+        }
+        if (channel != NULL) {
+            char channel_fd_s[16];
+            snprintf(channel_fd_s, sizeof(channel_fd_s), "%d", channel_fd);
+            setenv(UI_CHANNEL_ENV, channel_fd_s, 1);
+        }
         close(pipefd[0]);
         execve(binary, args, environ);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
     }
     close(pipefd[1]);
+    if (channel_fd >= 0) close(channel_fd);
 
     char* firmware_type = NULL;
     char* firmware_filename = NULL;
 
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print("%s", str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("unknown command [%s]\n", command);
+    if (channel == NULL) {
+        char buffer[1024];
+        FILE* from_child = fdopen(pipefd[0], "r");
+        while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
+            handle_updater_command(buffer, &firmware_type, &firmware_filename);
         }
+        fclose(from_child);
+    } else {
+        read_updater_output(pipefd[0], channel,
+                            &firmware_type, &firmware_filename);
+        close(pipefd[0]);
+        if (ui_channel_dropped(channel) > 0) {
+            LOGW("update binary dropped %u progress records\n",
+                 ui_channel_dropped(channel));
+        }
+        ui_channel_destroy(channel);
     }
-    fclose(from_child);
 
     int status;
     waitpid(pid, &status, 0);
@@ -373,6 +686,24 @@ try_update_binary(const char *path, ZipArchive *zip) {
     return INSTALL_SUCCESS;
 }
 
+typedef struct {
+    const char* path;
+    ZipArchive* zip;
+    const Certificate* keys;
+    int num_keys;
+    int result;
+} VerifyThreadArgs;
+
+static void*
+verify_thread(void* cookie) {
+    VerifyThreadArgs* args = (VerifyThreadArgs*)cookie;
+    args->result = verify_mapped_file(args->path, args->zip->fd,
+                                      (const unsigned char*)args->zip->map.addr,
+                                      args->zip->map.length,
+                                      args->keys, args->num_keys);
+    return NULL;
+}
+
 static int
 really_install_package(const char *path)
 {
@@ -410,12 +741,24 @@ really_install_package(const char *path)
     ui_print("Opening update package...\n");
 
     int err;
+    bool verified = false;
+
+    /* Try to open the package.
+     */
+    ZipArchive zip;
+    err = mzOpenZipArchive(path, &zip);
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        return INSTALL_CORRUPT;
+    }
 
+    int staged;
     if (signature_check_enabled) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            mzCloseZipArchive(&zip);
             return INSTALL_CORRUPT;
         }
         LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -426,24 +769,57 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        // Hash the package from minzip's mapping on another thread while
+        // this one stages the update binary from the same file.
+        VerifyThreadArgs args;
+        args.path = path;
+        args.zip = &zip;
+        args.keys = loadedKeys;
+        args.num_keys = numKeys;
+        pthread_t verifier;
+        bool threaded = pthread_create(&verifier, NULL, verify_thread, &args) == 0;
+        if (!threaded) {
+            verify_thread(&args);
+        }
+        staged = stage_update_binary(&zip);
+        if (threaded) {
+            pthread_join(verifier, NULL);
+        }
+        err = args.result;
         free(loadedKeys);
         LOGI("verify_file returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
             ui_show_text(1);
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
+            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip")) {
+                if (staged == INSTALL_SUCCESS) unlink(UPDATE_BINARY_PATH);
+                mzCloseZipArchive(&zip);
                 return INSTALL_CORRUPT;
+            }
+        } else {
+            verified = true;
         }
+    } else {
+        staged = stage_update_binary(&zip);
     }
 
-    /* Try to open the package.
+    if (staged != INSTALL_SUCCESS) {
+        mzCloseZipArchive(&zip);
+        return staged;
+    }
+
+    /* Without a good signature nothing has checked the package contents,
+     * so fall back to the zip CRCs before running anything from it.
      */
-    ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        return INSTALL_CORRUPT;
+    if (!verified) {
+        const ZipEntry* bad_entry;
+        ui_print("Checking package integrity...\n");
+        if (!mzIsZipArchiveIntact(&zip, 0, &bad_entry)) {
+            LOGE("Package entry %.*s is corrupt\n",
+                 bad_entry->fileNameLen, bad_entry->fileName);
+            mzCloseZipArchive(&zip);
+            return INSTALL_CORRUPT;
+        }
     }
 
     /* Verify and install the contents of the package.
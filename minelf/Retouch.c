@@ -32,37 +32,42 @@ typedef struct {
 #define false 0
 #define true 1
 
-static int32_t offs_prev;
-static uint32_t cont_prev;
+// Decoder state, kept per call so that several threads can mask files
+// at once.
+typedef struct {
+    int32_t offs_prev;
+    uint32_t cont_prev;
+} compression_state_t;
 
-static void init_compression_state(void) {
-    offs_prev = 0;
-    cont_prev = 0;
+static void init_compression_state(compression_state_t *state) {
+    state->offs_prev = 0;
+    state->cont_prev = 0;
 }
 
 // For details on the encoding used for relocation lists, please
 // refer to build/tools/retouch/retouch-prepare.c. The intent is to
 // save space by removing most of the inherent redundancy.
 
-static void decode_bytes(uint8_t *encoded_bytes, int encoded_size,
+static void decode_bytes(const compression_state_t *state,
+                         uint8_t *encoded_bytes, int encoded_size,
                          int32_t *dst_offset, uint32_t *dst_contents) {
     if (encoded_size == 2) {
-        *dst_offset = offs_prev + (((encoded_bytes[0]&0x60)>>5)+1)*4;
+        *dst_offset = state->offs_prev + (((encoded_bytes[0]&0x60)>>5)+1)*4;
 
         // if the original was negative, we need to 1-pad before applying delta
         int32_t tmp = (((encoded_bytes[0] & 0x0000001f) << 8) |
                        encoded_bytes[1]);
         if (tmp & 0x1000) tmp = 0xffffe000 | tmp;
-        *dst_contents = cont_prev + tmp;
+        *dst_contents = state->cont_prev + tmp;
     } else if (encoded_size == 3) {
-        *dst_offset = offs_prev + (((encoded_bytes[0]&0x30)>>4)+1)*4;
+        *dst_offset = state->offs_prev + (((encoded_bytes[0]&0x30)>>4)+1)*4;
 
         // if the original was negative, we need to 1-pad before applying delta
         int32_t tmp = (((encoded_bytes[0] & 0x0000000f) << 16) |
                        (encoded_bytes[1] << 8) |
                        encoded_bytes[2]);
         if (tmp & 0x80000) tmp = 0xfff00000 | tmp;
-        *dst_contents = cont_prev + tmp;
+        *dst_contents = state->cont_prev + tmp;
     } else {
         *dst_offset =
           (encoded_bytes[0]<<24) |
@@ -78,7 +83,8 @@ static void decode_bytes(uint8_t *encoded_bytes, int encoded_size,
     }
 }
 
-static uint8_t *decode_in_memory(uint8_t *encoded_bytes,
+static uint8_t *decode_in_memory(compression_state_t *state,
+                                 uint8_t *encoded_bytes,
                                  int32_t *offset, uint32_t *contents) {
     int input_size, charIx;
     uint8_t input[8];
@@ -98,10 +104,10 @@ static uint8_t *decode_in_memory(uint8_t *encoded_bytes,
     }
 
     // depends on the decoder state!
-    decode_bytes(input, input_size, offset, contents);
+    decode_bytes(state, input, input_size, offset, contents);
 
-    offs_prev = *offset;
-    cont_prev = *contents;
+    state->offs_prev = *offset;
+    state->cont_prev = *contents;
 
     return encoded_bytes;
 }
@@ -143,13 +149,14 @@ int retouch_mask_data(uint8_t *binary_object,
     // Retouched: let's go through the work then.
     int32_t offset_candidate = target_offset;
     bool offset_set = false, offset_mismatch = false;
-    init_compression_state();
+    compression_state_t state;
+    init_compression_state(&state);
     while (b_ptr < (uint8_t *)r_info) {
         int32_t retouch_entry_offset;
         uint32_t *retouch_entry;
         uint32_t retouch_original_value;
 
-        b_ptr = decode_in_memory(b_ptr,
+        b_ptr = decode_in_memory(&state, b_ptr,
                                  &retouch_entry_offset,
                                  &retouch_original_value);
         if (retouch_entry_offset < (-1) ||
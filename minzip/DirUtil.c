@@ -25,6 +25,7 @@
 #include <limits.h>
 
 #include "DirUtil.h"
+#include "Hash.h"
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
@@ -52,10 +53,121 @@ getPathDirStatus(const char *path)
     return DMISSING;
 }
 
-int
-dirCreateHierarchy(const char *path, int mode,
+struct DirCreateCache {
+    struct selabel_handle *sehnd;
+    HashTable *dirs;        // char* paths of directories known to exist
+    char *fsCreateCon;      // context last passed to setfscreatecon()
+};
+
+static unsigned int
+hashPath(const char *path)
+{
+    unsigned int hash = 2;
+
+    while (*path != '\0')
+        hash = hash * 31 + *path++;
+
+    return hash;
+}
+
+static int
+hashcmpDirPath(const void *tableItem, const void *looseItem)
+{
+    return strcmp((const char *)tableItem, (const char *)looseItem);
+}
+
+DirCreateCache *
+dirCreateCacheNew(struct selabel_handle *sehnd)
+{
+    DirCreateCache *cache = (DirCreateCache *)calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->sehnd = sehnd;
+    cache->dirs = mzHashTableCreate(64, free);
+    if (cache->dirs == NULL) {
+        dirCreateCacheFree(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void
+dirCreateCacheFree(DirCreateCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->fsCreateCon != NULL) {
+        setfscreatecon(NULL);
+        freecon(cache->fsCreateCon);
+    }
+    mzHashTableFree(cache->dirs);
+    free(cache);
+}
+
+static bool
+cacheHasDir(DirCreateCache *cache, const char *path)
+{
+    return mzHashTableLookup(cache->dirs, hashPath(path), (void *)path,
+            hashcmpDirPath, false) != NULL;
+}
+
+static void
+cacheAddDir(DirCreateCache *cache, const char *path)
+{
+    unsigned int hash = hashPath(path);
+    char *copy;
+
+    if (mzHashTableLookup(cache->dirs, hash, (void *)path,
+                hashcmpDirPath, false) != NULL) {
+        return;
+    }
+    copy = strdup(path);
+    if (copy != NULL) {
+        mzHashTableLookup(cache->dirs, hash, copy, hashcmpDirPath, true);
+    }
+}
+
+void
+dirCacheSetFileCreateCon(DirCreateCache *cache, const char *path, int mode)
+{
+    char *context = NULL;
+
+    if (cache->sehnd == NULL) {
+        return;
+    }
+    /* Every file is looked up on its own: file_contexts can give a
+     * single file a label different from its siblings'.
+     */
+    if (path != NULL &&
+            selabel_lookup(cache->sehnd, &context, path, mode) != 0) {
+        context = NULL;
+    }
+
+    /* Files created in the same directory almost always share a label,
+     * so skip the write to /proc when nothing changes.
+     */
+    bool unchanged = context == NULL ? cache->fsCreateCon == NULL :
+            (cache->fsCreateCon != NULL &&
+             strcmp(context, cache->fsCreateCon) == 0);
+    if (unchanged) {
+        if (context != NULL) {
+            freecon(context);
+        }
+        return;
+    }
+    setfscreatecon(context);
+    if (cache->fsCreateCon != NULL) {
+        freecon(cache->fsCreateCon);
+    }
+    cache->fsCreateCon = context;
+}
+
+static int
+createHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
-        struct selabel_handle *sehnd)
+        struct selabel_handle *sehnd, DirCreateCache *cache)
 {
     DirStatus ds;
 
@@ -100,14 +212,31 @@ dirCreateHierarchy(const char *path, int mode,
         cpath[pathLen + 1] = '\0';
     }
 
-    /* See if it already exists.
+    /* See if it already exists.  Cached paths are kept without the
+     * trailing slash.
      */
+    size_t cpathLen = strlen(cpath);
+    if (cache != NULL) {
+        cpath[cpathLen - 1] = '\0';
+        if (cacheHasDir(cache, cpath)) {
+            free(cpath);
+            return 0;
+        }
+    }
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        if (cache != NULL) {
+            cacheAddDir(cache, cpath);
+        }
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
+    if (cache != NULL) {
+        cpath[cpathLen - 1] = '/';
+    }
 
     /* Walk up the path from the root and make each level.
      * If a directory already exists, no big deal.
@@ -135,6 +264,10 @@ dirCreateHierarchy(const char *path, int mode,
         /* Check this part of the path and make a new directory
          * if necessary.
          */
+        if (cache != NULL && cacheHasDir(cache, cpath)) {
+            *p = '/';
+            continue;
+        }
         ds = getPathDirStatus(cpath);
         if (ds == DILLEGAL) {
             /* Could happen if some other process/thread is
@@ -147,7 +280,9 @@ dirCreateHierarchy(const char *path, int mode,
 
             char *secontext = NULL;
 
-            if (sehnd) {
+            if (cache != NULL) {
+                dirCacheSetFileCreateCon(cache, cpath, mode);
+            } else if (sehnd) {
                 selabel_lookup(sehnd, &secontext, cpath, mode);
                 setfscreatecon(secontext);
             }
@@ -169,7 +304,10 @@ dirCreateHierarchy(const char *path, int mode,
             }
         }
         // else, this directory already exists.
-        
+        if (cache != NULL) {
+            cacheAddDir(cache, cpath);
+        }
+
         /* Repair the path and continue.
          */
         *p = '/';
@@ -179,6 +317,22 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+int
+dirCreateHierarchy(const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd)
+{
+    return createHierarchy(path, mode, timestamp, stripFileName, sehnd, NULL);
+}
+
+int
+dirCreateHierarchyCached(DirCreateCache *cache, const char *path,
+        int mode, const struct utimbuf *timestamp, bool stripFileName)
+{
+    return createHierarchy(path, mode, timestamp, stripFileName,
+            cache->sehnd, cache);
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
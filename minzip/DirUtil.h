@@ -44,6 +44,38 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle* sehnd);
 
+/* Per-operation cache for dirCreateHierarchyCached().
+ *
+ * Remembers which directories are already known to exist, so that
+ * creating many files under the same few directories only touches the
+ * filesystem for paths it hasn't seen yet.  The cache also tracks the
+ * current fscreate context so it is only changed when the label does.
+ *
+ * The cache assumes nothing else removes the directories it has seen
+ * while it is alive; create one per extraction and free it afterwards.
+ */
+typedef struct DirCreateCache DirCreateCache;
+
+DirCreateCache *dirCreateCacheNew(struct selabel_handle *sehnd);
+
+/* Frees the cache and resets the fscreate context if it was changed.
+ */
+void dirCreateCacheFree(DirCreateCache *cache);
+
+/* Like dirCreateHierarchy(), but skips directories already in "cache"
+ * and labels new ones with the cache's selabel handle.
+ */
+int dirCreateHierarchyCached(DirCreateCache *cache, const char *path,
+        int mode, const struct utimbuf *timestamp, bool stripFileName);
+
+/* Sets the fscreate context to the label for <path, mode>, skipping the
+ * setfscreatecon() if it is the label already set.  Does nothing if the
+ * cache has no selabel handle.  Pass a NULL path to go back to the
+ * default context.
+ */
+void dirCacheSetFileCreateCon(DirCreateCache *cache, const char *path,
+        int mode);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
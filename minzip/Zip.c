@@ -9,8 +9,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -522,13 +524,33 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    if (pEntry->compression != STORED) {
+        return NULL;
+    }
+    if (pEntry->offset < 0 || pEntry->compLen != pEntry->uncompLen ||
+        (size_t)pEntry->offset > pArchive->map.length ||
+        (size_t)pEntry->compLen > pArchive->map.length - pEntry->offset) {
+        LOGW("Stored entry \"%.*s\" lies outside the archive\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return NULL;
+    }
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * Reads use pread() so that several threads can process entries from
+ * the same archive fd at once.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     size_t bytesLeft = pEntry->compLen;
+    off_t readOff = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
@@ -539,7 +561,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (count > sizeof(buf)) {
             count = sizeof(buf);
         }
-        n = read(pArchive->fd, buf, count);
+        n = TEMP_FAILURE_RETRY(pread(pArchive->fd, buf, count, readOff));
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
@@ -549,6 +571,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
             return false;
         }
         bytesLeft -= count;
+        readOff += count;
     }
     return true;
 }
@@ -563,8 +586,10 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     z_stream zstream;
     int zerr;
     long compRemaining;
+    off_t readOff;
 
     compRemaining = pEntry->compLen;
+    readOff = pEntry->offset;
 
     /*
      * Initialize the zlib stream.
@@ -605,13 +630,15 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = TEMP_FAILURE_RETRY(pread(pArchive->fd, readBuf, getSize,
+                        readOff));
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
             }
 
             compRemaining -= getSize;
+            readOff += getSize;
 
             zstream.next_in = readBuf;
             zstream.avail_in = getSize;
@@ -668,19 +695,15 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The archive's file offset is not used or changed, so this may be called
+ * concurrently from several threads on the same archive.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +718,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -731,6 +752,136 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
+/* Shared state for the workers of mzIsZipArchiveIntact().
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    pthread_mutex_t lock;
+    unsigned int nextEntry;     // next index to hand out
+    const ZipEntry *badEntry;   // first corrupt entry found, if any
+    volatile bool failed;       // tells the other workers to give up
+} IntactCheckState;
+
+typedef struct {
+    IntactCheckState *state;
+    unsigned long crc;
+} IntactCheckCookie;
+
+static bool intactCrcProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    IntactCheckCookie *icc = (IntactCheckCookie *)cookie;
+
+    /* Abandon a long inflate as soon as some other entry has failed.
+     */
+    if (icc->state->failed) {
+        return false;
+    }
+    icc->crc = crc32(icc->crc, data, dataLen);
+    return true;
+}
+
+static void *intactCheckThread(void *cookie)
+{
+    IntactCheckState *state = (IntactCheckState *)cookie;
+    const ZipArchive *pArchive = state->pArchive;
+
+    while (true) {
+        const ZipEntry *pEntry = NULL;
+
+        pthread_mutex_lock(&state->lock);
+        if (!state->failed && state->nextEntry < pArchive->numEntries) {
+            pEntry = pArchive->pEntries + state->nextEntry++;
+        }
+        pthread_mutex_unlock(&state->lock);
+        if (pEntry == NULL) {
+            break;
+        }
+
+        IntactCheckCookie icc;
+        icc.state = state;
+        icc.crc = crc32(0L, Z_NULL, 0);
+        bool ok = mzProcessZipEntryContents(pArchive, pEntry,
+                intactCrcProcessFunction, (void *)&icc);
+        if (!ok && state->failed) {
+            /* Cut short because another worker found a bad entry.
+             */
+            break;
+        }
+        if (!ok || icc.crc != (unsigned long)pEntry->crc32) {
+            pthread_mutex_lock(&state->lock);
+            if (state->badEntry == NULL) {
+                state->badEntry = pEntry;
+                state->failed = true;
+                if (ok) {
+                    LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                            pEntry->fileNameLen, pEntry->fileName,
+                            icc.crc, pEntry->crc32);
+                } else {
+                    LOGE("Can't calculate CRC for entry %.*s\n",
+                            pEntry->fileNameLen, pEntry->fileName);
+                }
+            }
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check the CRC on every entry in the archive, spreading the entries
+ * across up to "numThreads" threads.  Returns true if every entry is
+ * intact.
+ */
+bool mzIsZipArchiveIntact(const ZipArchive *pArchive, int numThreads,
+        const ZipEntry **pBadEntry)
+{
+    IntactCheckState state;
+    pthread_t threads[MZ_INTACT_MAX_THREADS];
+    int i, started;
+
+    if (numThreads <= 0) {
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MZ_INTACT_MAX_THREADS) {
+        numThreads = MZ_INTACT_MAX_THREADS;
+    }
+    if ((unsigned int)numThreads > pArchive->numEntries) {
+        numThreads = pArchive->numEntries;
+    }
+
+    state.pArchive = pArchive;
+    pthread_mutex_init(&state.lock, NULL);
+    state.nextEntry = 0;
+    state.badEntry = NULL;
+    state.failed = false;
+
+    /* The calling thread does its share of the work too.
+     */
+    started = 0;
+    for (i = 1; i < numThreads; i++) {
+        if (pthread_create(&threads[started], NULL, intactCheckThread,
+                    &state) != 0) {
+            LOGW("Can't start CRC thread; continuing with %d\n", started + 1);
+            break;
+        }
+        started++;
+    }
+    intactCheckThread(&state);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&state.lock);
+
+    if (pBadEntry != NULL) {
+        *pBadEntry = state.badEntry;
+    }
+    return state.badEntry == NULL;
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -769,40 +920,123 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     return true;
 }
 
-static bool writeProcessFunction(const unsigned char *data, int dataLen,
-                                 void *cookie)
-{
-    int fd = (int)(intptr_t)cookie;
+/*
+ * Batches inflated data into large writes.  Inflate hands us 32K at a
+ * time; writing each chunk straight to the target costs a syscall per
+ * chunk and lets the filesystem allocate the file in small pieces.
+ */
+enum { EXTRACT_SINK_SIZE = 256 * 1024, EXTRACT_SINK_ALIGN = 4096 };
 
-    ssize_t soFar = 0;
-    while (true) {
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+} ExtractSink;
+
+static bool writeFully(int fd, const unsigned char *data, size_t dataLen)
+{
+    size_t soFar = 0;
+    while (soFar < dataLen) {
         ssize_t n = write(fd, data+soFar, dataLen-soFar);
         if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
+            LOGE("Error writing %zu bytes from zip file from %p: %s\n",
                  dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
-                return false;
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
+            return false;
+        }
+        soFar += n;
+    }
+    return true;
+}
+
+static bool sinkFlush(ExtractSink *sink)
+{
+    bool ret = writeFully(sink->fd, sink->buf, sink->len);
+    sink->len = 0;
+    return ret;
+}
+
+static bool sinkProcessFunction(const unsigned char *data, int dataLen,
+                                void *cookie)
+{
+    ExtractSink *sink = (ExtractSink *)cookie;
+
+    while (dataLen > 0) {
+        size_t count = sink->cap - sink->len;
+        if (count > (size_t)dataLen) {
+            count = dataLen;
+        }
+        memcpy(sink->buf + sink->len, data, count);
+        sink->len += count;
+        data += count;
+        dataLen -= count;
+        if (sink->len == sink->cap && !sinkFlush(sink)) {
+            return false;
         }
     }
+    return true;
+}
+
+/*
+ * Uncompress "pEntry" to "fd" through "sink", whose buffer the caller
+ * provides so it can be reused across entries.
+ */
+static bool extractEntryToSink(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd, ExtractSink *sink)
+{
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start >= 0 && pEntry->uncompLen > 0) {
+        /* Reserve the whole file up front so the filesystem can lay it
+         * out contiguously.  Only a hint; not every filesystem supports it.
+         */
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, start, pEntry->uncompLen);
+    }
+
+    sink->fd = fd;
+    sink->len = 0;
+    if (!mzProcessZipEntryContents(pArchive, pEntry, sinkProcessFunction,
+                                   (void*)sink)) {
+        return false;
+    }
+    return sinkFlush(sink);
+}
+
+static bool allocSink(ExtractSink *sink, size_t cap)
+{
+    if (cap == 0) {
+        cap = 1;
+    }
+    sink->len = 0;
+    sink->cap = cap;
+    if (posix_memalign((void **)&sink->buf, EXTRACT_SINK_ALIGN, cap) != 0) {
+        LOGE("Can't allocate %zu bytes for extraction\n", cap);
+        sink->buf = NULL;
+        return false;
+    }
+    return true;
 }
 
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ *
+ * This does not sync "fd"; callers that need the data on disk should
+ * fsync() it once they are done with it.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)(intptr_t)fd);
+    ExtractSink sink;
+    bool ret;
+
+    if (!allocSink(&sink, pEntry->uncompLen < EXTRACT_SINK_SIZE ?
+                pEntry->uncompLen : EXTRACT_SINK_SIZE)) {
+        return false;
+    }
+    ret = extractEntryToSink(pArchive, pEntry, fd, &sink);
+    free(sink.buf);
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -977,6 +1211,26 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    /* Most entries share a handful of parent directories and labels;
+     * remember the directories and the current label for the length of
+     * this extraction.
+     */
+    DirCreateCache *dirCache = dirCreateCacheNew(sehnd);
+    if (dirCache == NULL) {
+        LOGE("Can't allocate directory cache\n");
+        free(zpath);
+        return false;
+    }
+
+    /* One write buffer for every file in this extraction.
+     */
+    ExtractSink sink;
+    if (!allocSink(&sink, EXTRACT_SINK_SIZE)) {
+        dirCreateCacheFree(dirCache);
+        free(zpath);
+        return false;
+    }
+
     /* Walk through the entries and extract anything whose path begins
      * with zpath.
 //TODO: since the entries are sorted, binary search for the first match
@@ -1045,8 +1299,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 #define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
+                int ret = dirCreateHierarchyCached(
+                        dirCache, targetFile, UNZIP_DIRMODE, timestamp, false);
                 if (ret != 0) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
                             targetFile, strerror(errno));
@@ -1059,8 +1313,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+            int ret = dirCreateHierarchyCached(
+                    dirCache, targetFile, UNZIP_DIRMODE, timestamp, true);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
@@ -1097,8 +1351,10 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 }
                 linkTarget[pEntry->uncompLen] = '\0';
 
-                /* Make the link.
+                /* Make the link.  Symlinks get the default context;
+                 * their labels are fixed up later by the script.
                  */
+                dirCacheSetFileCreateCon(dirCache, NULL, 0);
                 ret = symlink(linkTarget, targetFile);
                 if (ret != 0) {
                     LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
@@ -1115,20 +1371,10 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                  * Open the target for writing.
                  */
 
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
+                dirCacheSetFileCreateCon(dirCache, targetFile, UNZIP_FILEMODE);
 
                 int fd = creat(targetFile, UNZIP_FILEMODE);
 
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
                 if (fd < 0) {
                     LOGE("Can't create target file \"%s\": %s\n",
                             targetFile, strerror(errno));
@@ -1136,7 +1382,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+                ok = extractEntryToSink(pArchive, pEntry, fd, &sink);
                 close(fd);
                 if (!ok) {
                     LOGE("Error extracting \"%s\"\n", targetFile);
@@ -1157,6 +1403,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    free(sink.buf);
+    dirCreateCacheFree(dirCache);
     free(helper.buf);
     free(zpath);
 
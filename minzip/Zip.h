@@ -135,6 +135,14 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Return a pointer to the data of a STORED entry within the archive's
+ * read-only mapping, or NULL if the entry is compressed.  The pointer
+ * is valid until the archive is closed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
@@ -170,7 +178,21 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
- * Inflate and write an entry to a file.
+ * Check the CRC on every entry in the archive; return true if they are
+ * all correct.
+ *
+ * Entries are checked in parallel on up to "numThreads" threads (zero or
+ * less means one per online CPU).  The check stops as soon as a corrupt
+ * entry is found; if "pBadEntry" is non-NULL it is set to that entry, or
+ * to NULL if the archive is intact.
+ */
+enum { MZ_INTACT_MAX_THREADS = 8 };
+bool mzIsZipArchiveIntact(const ZipArchive *pArchive, int numThreads,
+        const ZipEntry **pBadEntry);
+
+/*
+ * Inflate and write an entry to a file.  Space for the entry is reserved
+ * up front and writes are batched; the file is not synced.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
@@ -209,6 +231,8 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
  *
+ * Extracted files are not synced; that is up to the caller.
+ *
  * Returns true on success, false on failure.
  */
 enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
@@ -182,6 +182,21 @@ mtd_find_partition_by_name(const char *name)
     return NULL;
 }
 
+const MtdPartition *
+mtd_find_partition_by_device_index(int device_index)
+{
+    if (g_mtd_state.partitions != NULL) {
+        int i;
+        for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
+            MtdPartition *p = &g_mtd_state.partitions[i];
+            if (p->device_index >= 0 && p->device_index == device_index) {
+                return p;
+            }
+        }
+    }
+    return NULL;
+}
+
 int
 mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
         const char *filesystem, int read_only)
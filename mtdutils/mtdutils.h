@@ -25,6 +25,10 @@ int mtd_scan_partitions(void);
 
 const MtdPartition *mtd_find_partition_by_name(const char *name);
 
+/* device_index is the N of /dev/mtd/mtdN and /dev/block/mtdblockN.
+ */
+const MtdPartition *mtd_find_partition_by_device_index(int device_index);
+
 /* mount_point is like "/system"
  * filesystem is like "yaffs2"
  */
@@ -479,17 +479,23 @@ copy_sideloaded_package(const char* original_path) {
   FILE* fin = fopen(original_path, "rb");
   if (fin == NULL) {
     LOGE("Failed to open %s (%s)\n", original_path, strerror(errno));
+    free(buffer);
     return NULL;
   }
   FILE* fout = fopen(copy_path, "wb");
   if (fout == NULL) {
     LOGE("Failed to open %s (%s)\n", copy_path, strerror(errno));
+    fclose(fin);
+    free(buffer);
     return NULL;
   }
 
   while ((read = fread(buffer, 1, BUFSIZ, fin)) > 0) {
     if (fwrite(buffer, 1, read, fout) != read) {
       LOGE("Short write of %s (%s)\n", copy_path, strerror(errno));
+      fclose(fout);
+      fclose(fin);
+      free(buffer);
       return NULL;
     }
   }
@@ -498,6 +504,7 @@ copy_sideloaded_package(const char* original_path) {
 
   if (fclose(fout) != 0) {
     LOGE("Failed to close %s (%s)\n", copy_path, strerror(errno));
+    fclose(fin);
     return NULL;
   }
 
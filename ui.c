@@ -703,6 +703,24 @@ int ui_get_text_cols() {
     return text_cols;
 }
 
+int ui_get_update_fps() {
+    return ui_parameters.update_fps;
+}
+
+static void append_text_locked(const char *buf) {
+    const char *ptr;
+    for (ptr = buf; *ptr != '\0'; ++ptr) {
+        if (*ptr == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    }
+    text[text_row][text_col] = '\0';
+}
+
 void ui_print(const char *fmt, ...) {
     char buf[256];
     va_list ap;
@@ -716,17 +734,19 @@ void ui_print(const char *fmt, ...) {
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
-        }
-        text[text_row][text_col] = '\0';
+        append_text_locked(buf);
+        update_screen_locked();
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
+void ui_print_text(const char *text) {
+    if (ui_log_stdout)
+        fputs(text, stdout);
+
+    pthread_mutex_lock(&gUpdateMutex);
+    if (text_rows > 0 && text_cols > 0) {
+        append_text_locked(text);
         update_screen_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ui_channel.h"
+
+#define UI_CHANNEL_MAGIC    0x48435549  // "UICH"
+#define UI_CHANNEL_VERSION  1
+
+// Must be a power of two.
+#define UI_CHANNEL_RING_SIZE (256 * 1024)
+
+// How long a producer waits for recovery to drain a full ring, in 5ms
+// steps: progress records are dropped after UI_CHANNEL_FULL_RETRIES,
+// while other records wait for as long as recovery keeps consuming and
+// give up only once the tail hasn't moved for UI_CHANNEL_STALL_RETRIES.
+#define UI_CHANNEL_FULL_RETRIES 200
+#define UI_CHANNEL_STALL_RETRIES 1000
+
+// Recovery's /tmp is a tmpfs, so a file there is plain shared memory.
+#define UI_CHANNEL_TEMPLATE "/tmp/ui_channel.XXXXXX"
+
+// The mapped layout shared by both processes.  head and tail count bytes
+// ever written and consumed; they wrap at 2^32, and the ring offset is
+// the count modulo the ring size.  Each record is a RecordHeader followed
+// by its payload, padded to four bytes, and may wrap around the end of
+// the ring.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    volatile uint32_t head;     // written only by the updater
+    volatile uint32_t tail;     // written only by recovery
+    volatile uint32_t dropped;  // written only by the updater
+    unsigned char ring[];
+} UiChannelShared;
+
+typedef struct {
+    uint16_t type;
+    uint16_t len;
+} RecordHeader;
+
+struct UiChannel {
+    UiChannelShared* shared;
+    size_t map_size;
+    bool stalled;           // producer: a full-ring wait timed out...
+    uint32_t stalled_tail;  // ...while the tail was here
+};
+
+#define RECORD_SIZE(len) \
+    ((sizeof(RecordHeader) + (len) + 3) & ~(size_t)3)
+
+static UiChannel*
+map_channel(int fd, size_t size) {
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return NULL;
+    UiChannel* channel = malloc(sizeof(UiChannel));
+    if (channel == NULL) {
+        munmap(addr, size);
+        return NULL;
+    }
+    channel->shared = addr;
+    channel->map_size = size;
+    channel->stalled = false;
+    return channel;
+}
+
+UiChannel* ui_channel_create(int* fd) {
+    char path[] = UI_CHANNEL_TEMPLATE;
+    int tmp = mkstemp(path);
+    if (tmp < 0) return NULL;
+    unlink(path);
+
+    size_t size = sizeof(UiChannelShared) + UI_CHANNEL_RING_SIZE;
+    if (ftruncate(tmp, size) != 0) {
+        close(tmp);
+        return NULL;
+    }
+    UiChannel* channel = map_channel(tmp, size);
+    if (channel == NULL) {
+        close(tmp);
+        return NULL;
+    }
+
+    // ftruncate() zero-filled the file, so head, tail and dropped
+    // already start at 0.
+    channel->shared->ring_size = UI_CHANNEL_RING_SIZE;
+    channel->shared->version = UI_CHANNEL_VERSION;
+    __sync_synchronize();
+    channel->shared->magic = UI_CHANNEL_MAGIC;
+
+    *fd = tmp;
+    return channel;
+}
+
+UiChannel* ui_channel_attach(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(UiChannelShared)) {
+        return NULL;
+    }
+    UiChannel* channel = map_channel(fd, st.st_size);
+    if (channel == NULL) return NULL;
+
+    const UiChannelShared* shared = channel->shared;
+    uint32_t ring_size = shared->ring_size;
+    if (shared->magic != UI_CHANNEL_MAGIC ||
+        shared->version != UI_CHANNEL_VERSION ||
+        ring_size == 0 || (ring_size & (ring_size - 1)) != 0 ||
+        ring_size > st.st_size - sizeof(UiChannelShared)) {
+        ui_channel_destroy(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+void ui_channel_destroy(UiChannel* channel) {
+    if (channel == NULL) return;
+    munmap(channel->shared, channel->map_size);
+    free(channel);
+}
+
+// Copy len bytes in or out of the ring at the free-running offset pos.
+static void
+ring_copy_in(UiChannelShared* shared, uint32_t pos,
+             const void* data, size_t len) {
+    uint32_t off = pos & (shared->ring_size - 1);
+    size_t first = shared->ring_size - off;
+    if (first > len) first = len;
+    memcpy(shared->ring + off, data, first);
+    memcpy(shared->ring, (const unsigned char*)data + first, len - first);
+}
+
+static void
+ring_copy_out(const UiChannelShared* shared, uint32_t pos,
+              void* data, size_t len) {
+    uint32_t off = pos & (shared->ring_size - 1);
+    size_t first = shared->ring_size - off;
+    if (first > len) first = len;
+    memcpy(data, shared->ring + off, first);
+    memcpy((unsigned char*)data + first, shared->ring, len - first);
+}
+
+// Only progress records may be dropped (and counted in 'dropped') when
+// recovery falls behind; the next one supersedes them anyway.  Anything
+// else is only given up on if recovery stops draining altogether, and
+// then the caller has to deliver it some other way.
+static bool
+write_record(UiChannel* channel, int type, bool droppable,
+             const void* a, size_t alen, const void* b, size_t blen) {
+    UiChannelShared* shared = channel->shared;
+    size_t len = alen + blen;
+    size_t need = RECORD_SIZE(len);
+
+    uint32_t head = shared->head;
+    uint32_t tail = shared->tail;
+    int retries = 0;
+    while (shared->ring_size - (head - tail) < need) {
+        // Once a record has given up, don't make every later one wait
+        // out the same stall: fail at once until recovery moves the tail.
+        if ((channel->stalled && tail == channel->stalled_tail) ||
+            ++retries > (droppable ? UI_CHANNEL_FULL_RETRIES
+                                   : UI_CHANNEL_STALL_RETRIES)) {
+            channel->stalled = true;
+            channel->stalled_tail = tail;
+            if (droppable) shared->dropped++;
+            return false;
+        }
+        usleep(5000);
+        if (!droppable && shared->tail != tail) retries = 0;
+        tail = shared->tail;
+    }
+    // Make sure recovery is finished with the space before reusing it.
+    __sync_synchronize();
+
+    RecordHeader hdr;
+    hdr.type = type;
+    hdr.len = len;
+    ring_copy_in(shared, head, &hdr, sizeof(hdr));
+    ring_copy_in(shared, head + sizeof(hdr), a, alen);
+    ring_copy_in(shared, head + sizeof(hdr) + alen, b, blen);
+
+    // Publish the record only once its bytes are visible.
+    __sync_synchronize();
+    shared->head = head + need;
+    return true;
+}
+
+bool ui_channel_progress(UiChannel* channel, float fraction, int seconds) {
+    UiProgressRecord rec;
+    rec.fraction = fraction;
+    rec.seconds = seconds;
+    return write_record(channel, UI_RECORD_PROGRESS, true,
+                        &rec, sizeof(rec), NULL, 0);
+}
+
+bool ui_channel_set_progress(UiChannel* channel, float fraction) {
+    return write_record(channel, UI_RECORD_SET_PROGRESS, true,
+                        &fraction, sizeof(fraction), NULL, 0);
+}
+
+size_t ui_channel_print(UiChannel* channel, const char* text, size_t len) {
+    size_t done = 0;
+    do {
+        size_t n = len - done;
+        if (n > UI_RECORD_MAX_PAYLOAD) n = UI_RECORD_MAX_PAYLOAD;
+        if (!write_record(channel, UI_RECORD_PRINT, false,
+                          text + done, n, NULL, 0)) {
+            break;
+        }
+        done += n;
+    } while (done < len);
+    return done;
+}
+
+bool ui_channel_timing(UiChannel* channel, const char* name, uint32_t msec) {
+    size_t len = strlen(name);
+    if (len > UI_RECORD_MAX_PAYLOAD - sizeof(UiTimingRecord)) {
+        len = UI_RECORD_MAX_PAYLOAD - sizeof(UiTimingRecord);
+    }
+    return write_record(channel, UI_RECORD_TIMING, false,
+                        &msec, sizeof(msec), name, len);
+}
+
+bool ui_channel_read(UiChannel* channel, int* type, void* buf, size_t* len) {
+    UiChannelShared* shared = channel->shared;
+    uint32_t tail = shared->tail;
+    uint32_t avail = shared->head - tail;
+    if (avail == 0) return false;
+    // Don't look at the record until after head says it's complete.
+    __sync_synchronize();
+
+    RecordHeader hdr;
+    if (avail < sizeof(hdr)) goto corrupt;
+    ring_copy_out(shared, tail, &hdr, sizeof(hdr));
+    if (hdr.len > UI_RECORD_MAX_PAYLOAD || RECORD_SIZE(hdr.len) > avail) {
+        goto corrupt;
+    }
+    ring_copy_out(shared, tail + sizeof(hdr), buf, hdr.len);
+    *type = hdr.type;
+    *len = hdr.len;
+
+    // Finish copying before handing the space back to the updater.
+    __sync_synchronize();
+    shared->tail = tail + RECORD_SIZE(hdr.len);
+    return true;
+
+corrupt:
+    // The updater scribbled over the ring; throw away what's there.
+    shared->tail = shared->head;
+    return false;
+}
+
+uint32_t ui_channel_dropped(const UiChannel* channel) {
+    return channel->shared->dropped;
+}
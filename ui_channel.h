@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_UI_CHANNEL_H_
+#define RECOVERY_UI_CHANNEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The "v4" progress/log channel between recovery and update-binary.
+//
+// Recovery creates a shared-memory ring buffer and passes its fd to the
+// update binary in the UI_CHANNEL_ENV environment variable.  An updater
+// that understands the variable writes typed binary records into the
+// ring instead of "progress", "set_progress" and "ui_print" lines on the
+// command pipe; recovery drains the ring at frame rate and coalesces
+// what it finds into one redraw.  Everything else (firmware, wipe_cache)
+// still goes over the pipe, and updaters that don't look at the variable
+// keep using the text protocol unchanged.
+//
+// The ring has exactly one producer (the updater) and one consumer
+// (recovery).
+
+#define UI_CHANNEL_ENV "UPDATER_UI_CHANNEL"
+
+enum {
+    UI_RECORD_PROGRESS = 1,      // UiProgressRecord
+    UI_RECORD_SET_PROGRESS = 2,  // float fraction
+    UI_RECORD_PRINT = 3,         // text, not NUL-terminated
+    UI_RECORD_TIMING = 4,        // UiTimingRecord
+};
+
+// Longest payload of a single record.  Longer ui_print text is split.
+#define UI_RECORD_MAX_PAYLOAD 1024
+
+typedef struct {
+    float fraction;
+    int32_t seconds;
+} UiProgressRecord;
+
+typedef struct {
+    uint32_t msec;
+    char name[];        // not NUL-terminated
+} UiTimingRecord;
+
+typedef struct UiChannel UiChannel;
+
+// Recovery side.  Creates an empty channel; *fd is left open (and
+// inheritable) for the child and must be closed by the caller after
+// the fork.  Returns NULL on failure.
+UiChannel* ui_channel_create(int* fd);
+
+// Update-binary side.  Maps the channel recovery passed in fd.  Returns
+// NULL if fd doesn't refer to a compatible channel.
+UiChannel* ui_channel_attach(int fd);
+
+void ui_channel_destroy(UiChannel* channel);
+
+// Producer calls.  If the ring is full, the progress calls wait briefly
+// for recovery to make room and return false if the record had to be
+// dropped; a later progress record makes up for it.
+bool ui_channel_progress(UiChannel* channel, float fraction, int seconds);
+bool ui_channel_set_progress(UiChannel* channel, float fraction);
+
+// Text is never dropped: these wait for as long as recovery keeps
+// draining the ring.  If it stops, ui_channel_print() returns how many
+// bytes of text it did queue and ui_channel_timing() returns false, and
+// the caller should send the rest over the command pipe.
+size_t ui_channel_print(UiChannel* channel, const char* text, size_t len);
+bool ui_channel_timing(UiChannel* channel, const char* name, uint32_t msec);
+
+// Consumer call.  Copies the oldest record's payload into buf (which
+// must hold UI_RECORD_MAX_PAYLOAD bytes), stores its type and length,
+// and returns true; returns false if the ring is empty.
+bool ui_channel_read(UiChannel* channel, int* type, void* buf, size_t* len);
+
+// Number of progress records the producer has dropped so far.
+uint32_t ui_channel_dropped(const UiChannel* channel);
+
+#endif  // RECOVERY_UI_CHANNEL_H_
@@ -4,6 +4,8 @@ LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
 	../mounts.c \
+	../ui_channel.c \
+	blockimg.c \
 	install.c \
 	updater.c
 
@@ -32,6 +34,9 @@ LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
+ifeq ($(ENABLE_ZSTD_PATCH),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
 LOCAL_STATIC_LIBRARIES += libselinux
@@ -81,3 +86,31 @@ LOCAL_MODULE := updater
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+#
+# Host-side test of the block image engine against file-backed
+# images.  Run it with a scratch directory (default /tmp) as argument.
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	blockimg.c \
+	blockimg_test.c \
+	../applypatch/bsdiff.c \
+	../applypatch/bspatch.c \
+	../applypatch/imgpatch.c \
+	../applypatch/utils.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/.. external/bzip2 external/zlib
+LOCAL_STATIC_LIBRARIES := libmincrypt libbz libz
+ifeq ($(ENABLE_ZSTD_PATCH),true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := blockimg_test
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
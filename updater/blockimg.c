@@ -0,0 +1,775 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "blockimg.h"
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+
+// Applies a transfer list (see blockimg.h) to a block device.  Every
+// command reads and writes whole blocks at known offsets, so an update
+// is a series of large sequential writes instead of a filesystem walk,
+// and the result can be checked with BlockRangeSha1().
+
+// Largest piece of a range read or written at once.
+#define BLOCK_IO_CHUNK (256 * BLOCKSIZE)
+
+// A parsed rangeset: count [start, end) pairs covering size blocks.
+// Block numbers are 64-bit so that offsets into large partitions can be
+// computed on 32-bit devices; size is limited so that the whole set
+// fits in a buffer.
+typedef struct {
+    int count;
+    size_t size;
+    uint64_t pos[0];
+} RangeSet;
+
+static RangeSet* parse_range(const char* text) {
+    if (text == NULL) return NULL;
+
+    char* end;
+    errno = 0;
+    long num = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != ',' || num <= 0 || num % 2 != 0 ||
+        num > 1024 * 1024) {
+        goto bad;
+    }
+
+    RangeSet* rs = malloc(sizeof(RangeSet) + num * sizeof(uint64_t));
+    if (rs == NULL) return NULL;
+    rs->count = num / 2;
+    rs->size = 0;
+
+    int i;
+    const char* p = end + 1;
+    for (i = 0; i < num; ++i) {
+        errno = 0;
+        unsigned long long v = strtoull(p, &end, 10);
+        if (errno != 0 || end == p || *p == '-' ||
+            (i + 1 < num ? *end != ',' : *end != '\0') ||
+            v > (unsigned long long)(off64_t)(~0ULL >> 1) / BLOCKSIZE) {
+            free(rs);
+            goto bad;
+        }
+        rs->pos[i] = v;
+        p = end + 1;
+    }
+    uint64_t size = 0;
+    for (i = 0; i < rs->count; ++i) {
+        if (rs->pos[i*2] >= rs->pos[i*2+1]) {
+            free(rs);
+            goto bad;
+        }
+        size += rs->pos[i*2+1] - rs->pos[i*2];
+        if (size > SIZE_MAX / BLOCKSIZE) {
+            free(rs);
+            goto bad;
+        }
+    }
+    rs->size = size;
+    return rs;
+
+  bad:
+    fprintf(stderr, "bad rangeset \"%s\"\n", text);
+    return NULL;
+}
+
+static int seek_block(int fd, uint64_t block) {
+    off64_t off = (off64_t)block * BLOCKSIZE;
+    if (lseek64(fd, off, SEEK_SET) != off) {
+        fprintf(stderr, "seek to block %" PRIu64 " failed: %s\n",
+                block, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int read_all(int fd, unsigned char* data, size_t size) {
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = TEMP_FAILURE_RETRY(read(fd, data + so_far, size - so_far));
+        if (r <= 0) {
+            fprintf(stderr, "read failed: %s\n",
+                    r < 0 ? strerror(errno) : "unexpected end of device");
+            return -1;
+        }
+        so_far += r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = TEMP_FAILURE_RETRY(write(fd, data + written,
+                                             size - written));
+        if (w <= 0) {
+            fprintf(stderr, "write failed: %s\n",
+                    w < 0 ? strerror(errno) : "no progress");
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+}
+
+// Read the blocks of rs, in order, into buffer.
+static int read_ranges(int fd, const RangeSet* rs, unsigned char* buffer) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        if (seek_block(fd, rs->pos[i*2]) != 0) return -1;
+        size_t size = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (read_all(fd, buffer, size) != 0) return -1;
+        buffer += size;
+    }
+    return 0;
+}
+
+static int write_ranges(int fd, const RangeSet* rs,
+                        const unsigned char* buffer) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        if (seek_block(fd, rs->pos[i*2]) != 0) return -1;
+        size_t size = (size_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (write_all(fd, buffer, size) != 0) return -1;
+        buffer += size;
+    }
+    return 0;
+}
+
+// Patch output is written to the target ranges as it's produced.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int p_block;            // index of the range being written
+    size_t p_remain;        // bytes left in that range
+} RangeSinkState;
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size, void* token) {
+    RangeSinkState* rss = (RangeSinkState*) token;
+    ssize_t written = 0;
+    while (size > 0) {
+        if (rss->p_remain == 0) {
+            if (rss->p_block >= rss->tgt->count) {
+                fprintf(stderr, "patch output exceeds target ranges\n");
+                break;
+            }
+            if (seek_block(rss->fd, rss->tgt->pos[rss->p_block*2]) != 0) {
+                break;
+            }
+            rss->p_remain = (size_t)(rss->tgt->pos[rss->p_block*2+1] -
+                                     rss->tgt->pos[rss->p_block*2]) * BLOCKSIZE;
+            rss->p_block++;
+        }
+        size_t n = size < (ssize_t)rss->p_remain ? (size_t)size : rss->p_remain;
+        if (write_all(rss->fd, data, n) != 0) break;
+        data += n;
+        size -= n;
+        written += n;
+        rss->p_remain -= n;
+    }
+    return written;
+}
+
+typedef struct {
+    char* id;
+    unsigned char* data;
+    size_t blocks;
+} StashEntry;
+
+typedef struct {
+    int fd;
+    int version;
+    const BlockImageSources* sources;
+
+    StashEntry* stash;
+    int stash_count;
+    int max_stash_entries;
+    size_t stashed_blocks;
+    size_t max_stash_blocks;
+
+    unsigned char* buffer;      // holds a command's source blocks
+    size_t buffer_size;
+
+    size_t written;             // blocks written so far
+    size_t total;               // blocks the transfer list will write
+} CommandState;
+
+static unsigned char* get_buffer(CommandState* cs, size_t blocks) {
+    size_t size = blocks * BLOCKSIZE;
+    if (size / BLOCKSIZE != blocks) return NULL;
+    if (size > cs->buffer_size) {
+        unsigned char* b = realloc(cs->buffer, size);
+        if (b == NULL) {
+            fprintf(stderr, "failed to allocate %zu blocks\n", blocks);
+            return NULL;
+        }
+        cs->buffer = b;
+        cs->buffer_size = size;
+    }
+    return cs->buffer;
+}
+
+static StashEntry* find_stash(CommandState* cs, const char* id) {
+    int i;
+    for (i = 0; i < cs->stash_count; ++i) {
+        if (strcmp(cs->stash[i].id, id) == 0) return cs->stash + i;
+    }
+    return NULL;
+}
+
+static void free_stash(CommandState* cs, StashEntry* e) {
+    cs->stashed_blocks -= e->blocks;
+    free(e->id);
+    free(e->data);
+    *e = cs->stash[--cs->stash_count];
+}
+
+static bool range_ascending(const RangeSet* rs) {
+    int i;
+    for (i = 1; i < rs->count; ++i) {
+        if (rs->pos[i*2] < rs->pos[i*2-1]) return false;
+    }
+    return true;
+}
+
+// Spread the packed blocks at the start of buffer out to the block
+// offsets in locs, which must be ascending.  Done back to front, since
+// a block only ever moves to a later offset.
+static void move_range(unsigned char* buffer, const RangeSet* locs) {
+    size_t from = locs->size;
+    int i;
+    for (i = locs->count - 1; i >= 0; --i) {
+        size_t blocks = locs->pos[i*2+1] - locs->pos[i*2];
+        from -= blocks;
+        memmove(buffer + (size_t)locs->pos[i*2] * BLOCKSIZE,
+                buffer + from * BLOCKSIZE, blocks * BLOCKSIZE);
+    }
+}
+
+// Copy a stash entry into buffer at the block offsets in locs.
+static int apply_stash(CommandState* cs, char* word, unsigned char* buffer,
+                       size_t src_blocks) {
+    char* colon = strchr(word, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "bad stash reference \"%s\"\n", word);
+        return -1;
+    }
+    *colon = '\0';
+    StashEntry* e = find_stash(cs, word);
+    if (e == NULL) {
+        fprintf(stderr, "no stash entry \"%s\"\n", word);
+        return -1;
+    }
+    RangeSet* locs = parse_range(colon + 1);
+    if (locs == NULL) return -1;
+    if (locs->size != e->blocks ||
+        locs->pos[locs->count*2-1] > src_blocks) {
+        fprintf(stderr, "stash entry \"%s\" doesn't fit %s\n",
+                word, colon + 1);
+        free(locs);
+        return -1;
+    }
+    const unsigned char* data = e->data;
+    int i;
+    for (i = 0; i < locs->count; ++i) {
+        size_t size = (size_t)(locs->pos[i*2+1] - locs->pos[i*2]) * BLOCKSIZE;
+        memcpy(buffer + (size_t)locs->pos[i*2] * BLOCKSIZE, data, size);
+        data += size;
+    }
+    free(locs);
+    return 0;
+}
+
+// Parse a command's source (see blockimg.h) from the remaining words
+// and load it into cs->buffer.  Returns the number of blocks loaded,
+// or 0 on failure.
+static size_t load_source(CommandState* cs, char* src_word, char** save) {
+    if (cs->version == 1) {
+        RangeSet* src = parse_range(src_word);
+        if (src == NULL) return 0;
+        unsigned char* buffer = get_buffer(cs, src->size);
+        size_t blocks = src->size;
+        if (buffer == NULL || read_ranges(cs->fd, src, buffer) != 0) {
+            blocks = 0;
+        }
+        free(src);
+        return blocks;
+    }
+
+    char* end;
+    size_t blocks = src_word ? strtoul(src_word, &end, 10) : 0;
+    if (blocks == 0 || *end != '\0') {
+        fprintf(stderr, "bad source block count\n");
+        return 0;
+    }
+    unsigned char* buffer = get_buffer(cs, blocks);
+    if (buffer == NULL) return 0;
+
+    char* word = strtok_r(NULL, " ", save);
+    if (word == NULL) {
+        fprintf(stderr, "missing source ranges\n");
+        return 0;
+    }
+    if (strcmp(word, "-") != 0) {
+        RangeSet* src = parse_range(word);
+        if (src == NULL) return 0;
+        if (src->size > blocks) {
+            fprintf(stderr, "source ranges exceed %zu blocks\n", blocks);
+            free(src);
+            return 0;
+        }
+        int r = read_ranges(cs->fd, src, buffer);
+        size_t read = src->size;
+        free(src);
+        if (r != 0) return 0;
+
+        word = strtok_r(NULL, " ", save);
+        if (word != NULL) {
+            RangeSet* locs = parse_range(word);
+            if (locs == NULL) return 0;
+            if (locs->size != read || !range_ascending(locs) ||
+                locs->pos[locs->count*2-1] > blocks) {
+                fprintf(stderr, "source locations don't match ranges\n");
+                free(locs);
+                return 0;
+            }
+            move_range(buffer, locs);
+            free(locs);
+        } else if (read != blocks) {
+            fprintf(stderr, "source ranges have %zu blocks, expected %zu\n",
+                    read, blocks);
+            return 0;
+        }
+    }
+
+    while ((word = strtok_r(NULL, " ", save)) != NULL) {
+        if (apply_stash(cs, word, buffer, blocks) != 0) return 0;
+    }
+    return blocks;
+}
+
+static void report_progress(CommandState* cs, size_t blocks) {
+    cs->written += blocks;
+    if (cs->sources->progress != NULL && cs->total > 0) {
+        float fraction = (float)cs->written / cs->total;
+        cs->sources->progress(fraction > 1.0f ? 1.0f : fraction,
+                              cs->sources->progress_cookie);
+    }
+}
+
+static int PerformCommandZero(CommandState* cs, char** save) {
+    RangeSet* tgt = parse_range(strtok_r(NULL, " ", save));
+    if (tgt == NULL) return -1;
+
+    size_t chunk = tgt->size < BLOCK_IO_CHUNK / BLOCKSIZE ?
+            tgt->size : BLOCK_IO_CHUNK / BLOCKSIZE;
+    unsigned char* buffer = get_buffer(cs, chunk);
+    int result = -1;
+    if (buffer == NULL) goto done;
+    memset(buffer, 0, chunk * BLOCKSIZE);
+
+    int i;
+    for (i = 0; i < tgt->count; ++i) {
+        if (seek_block(cs->fd, tgt->pos[i*2]) != 0) goto done;
+        size_t left = tgt->pos[i*2+1] - tgt->pos[i*2];
+        while (left > 0) {
+            size_t n = left < chunk ? left : chunk;
+            if (write_all(cs->fd, buffer, n * BLOCKSIZE) != 0) goto done;
+            left -= n;
+        }
+    }
+    report_progress(cs, tgt->size);
+    result = 0;
+
+  done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandNew(CommandState* cs, char** save) {
+    RangeSet* tgt = parse_range(strtok_r(NULL, " ", save));
+    if (tgt == NULL) return -1;
+
+    size_t chunk = tgt->size < BLOCK_IO_CHUNK / BLOCKSIZE ?
+            tgt->size : BLOCK_IO_CHUNK / BLOCKSIZE;
+    unsigned char* buffer = get_buffer(cs, chunk);
+    int result = -1;
+    if (buffer == NULL) goto done;
+
+    int i;
+    for (i = 0; i < tgt->count; ++i) {
+        if (seek_block(cs->fd, tgt->pos[i*2]) != 0) goto done;
+        size_t left = tgt->pos[i*2+1] - tgt->pos[i*2];
+        while (left > 0) {
+            size_t n = left < chunk ? left : chunk;
+            if (cs->sources->read_new(buffer, n * BLOCKSIZE,
+                                      cs->sources->new_cookie) != 0) {
+                fprintf(stderr, "new data ended early\n");
+                goto done;
+            }
+            if (write_all(cs->fd, buffer, n * BLOCKSIZE) != 0) goto done;
+            left -= n;
+        }
+    }
+    report_progress(cs, tgt->size);
+    result = 0;
+
+  done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandErase(CommandState* cs, char** save) {
+    RangeSet* tgt = parse_range(strtok_r(NULL, " ", save));
+    if (tgt == NULL) return -1;
+
+    // Only block devices can discard; an image file is left as it is.
+    struct stat st;
+    int result = 0;
+    if (fstat(cs->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int i;
+        for (i = 0; i < tgt->count; ++i) {
+            uint64_t range[2];
+            range[0] = tgt->pos[i*2] * BLOCKSIZE;
+            range[1] = (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+            if (ioctl(cs->fd, BLKDISCARD, &range) < 0) {
+                fprintf(stderr, "BLKDISCARD of blocks %" PRIu64 "-%" PRIu64
+                        " failed: %s\n",
+                        tgt->pos[i*2], tgt->pos[i*2+1], strerror(errno));
+                result = -1;
+                break;
+            }
+        }
+    }
+    free(tgt);
+    return result;
+}
+
+// Reads the target (and, in version 1, the source) of move, bsdiff and
+// imgdiff, and loads the source into cs->buffer.
+static RangeSet* load_transfer(CommandState* cs, char** save,
+                               size_t* src_blocks) {
+    char* first = strtok_r(NULL, " ", save);
+    char* second = strtok_r(NULL, " ", save);
+    RangeSet* tgt = parse_range(cs->version == 1 ? second : first);
+    if (tgt == NULL) return NULL;
+    *src_blocks = load_source(cs, cs->version == 1 ? first : second, save);
+    if (*src_blocks == 0) {
+        free(tgt);
+        return NULL;
+    }
+    return tgt;
+}
+
+static int PerformCommandMove(CommandState* cs, char** save) {
+    size_t src_blocks;
+    RangeSet* tgt = load_transfer(cs, save, &src_blocks);
+    if (tgt == NULL) return -1;
+
+    int result = -1;
+    if (src_blocks != tgt->size) {
+        fprintf(stderr, "move of %zu blocks to %zu\n", src_blocks, tgt->size);
+    } else if (write_ranges(cs->fd, tgt, cs->buffer) == 0) {
+        report_progress(cs, tgt->size);
+        result = 0;
+    }
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandDiff(CommandState* cs, const char* cmd, char** save) {
+    char* start_word = strtok_r(NULL, " ", save);
+    char* len_word = strtok_r(NULL, " ", save);
+    if (start_word == NULL || len_word == NULL) {
+        fprintf(stderr, "missing patch offset or length\n");
+        return -1;
+    }
+    char* end1;
+    char* end2;
+    size_t offset = strtoul(start_word, &end1, 10);
+    size_t len = strtoul(len_word, &end2, 10);
+    if (*end1 != '\0' || *end2 != '\0' ||
+        offset > cs->sources->patch_len ||
+        len > cs->sources->patch_len - offset) {
+        fprintf(stderr, "patch %s+%s is outside the patch data\n",
+                start_word, len_word);
+        return -1;
+    }
+
+    size_t src_blocks;
+    RangeSet* tgt = load_transfer(cs, save, &src_blocks);
+    if (tgt == NULL) return -1;
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = len;
+    patch.data = (char*)(cs->sources->patch_data + offset);
+    patch.backing = NULL;
+
+    RangeSinkState rss;
+    rss.fd = cs->fd;
+    rss.tgt = tgt;
+    rss.p_block = 0;
+    rss.p_remain = 0;
+
+    // The patch code insists on a context to hash the output into.
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+
+    int status;
+    if (strcmp(cmd, "imgdiff") == 0) {
+        status = ApplyImagePatch(cs->buffer, src_blocks * BLOCKSIZE, &patch,
+                                 RangeSinkWrite, &rss, &ctx, NULL);
+    } else {
+        status = ApplyBSDiffPatch(cs->buffer, src_blocks * BLOCKSIZE, &patch,
+                                  0, RangeSinkWrite, &rss, &ctx);
+    }
+
+    int result = -1;
+    if (status != 0) {
+        fprintf(stderr, "%s failed\n", cmd);
+    } else if (rss.p_block != tgt->count || rss.p_remain != 0) {
+        fprintf(stderr, "%s didn't fill its %zu target blocks\n",
+                cmd, tgt->size);
+    } else {
+        report_progress(cs, tgt->size);
+        result = 0;
+    }
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandStash(CommandState* cs, char** save) {
+    char* id = strtok_r(NULL, " ", save);
+    RangeSet* src = parse_range(strtok_r(NULL, " ", save));
+    if (id == NULL || src == NULL) {
+        free(src);
+        return -1;
+    }
+    if (find_stash(cs, id) != NULL) {
+        fprintf(stderr, "stash entry \"%s\" already exists\n", id);
+        free(src);
+        return -1;
+    }
+    if (cs->stash_count >= cs->max_stash_entries ||
+        cs->stashed_blocks + src->size > cs->max_stash_blocks) {
+        fprintf(stderr, "stash limits (%d entries, %zu blocks) exceeded\n",
+                cs->max_stash_entries, cs->max_stash_blocks);
+        free(src);
+        return -1;
+    }
+
+    StashEntry* e = cs->stash + cs->stash_count;
+    e->data = malloc(src->size * BLOCKSIZE);
+    if (e->data == NULL) {
+        fprintf(stderr, "failed to allocate %zu blocks to stash\n",
+                src->size);
+        free(src);
+        return -1;
+    }
+    if (read_ranges(cs->fd, src, e->data) != 0) {
+        free(e->data);
+        free(src);
+        return -1;
+    }
+    e->id = strdup(id);
+    e->blocks = src->size;
+    cs->stash_count++;
+    cs->stashed_blocks += src->size;
+    free(src);
+    return 0;
+}
+
+static int PerformCommandFree(CommandState* cs, char** save) {
+    char* id = strtok_r(NULL, " ", save);
+    StashEntry* e = id ? find_stash(cs, id) : NULL;
+    if (e == NULL) {
+        fprintf(stderr, "no stash entry \"%s\" to free\n", id ? id : "");
+        return -1;
+    }
+    free_stash(cs, e);
+    return 0;
+}
+
+static int parse_header_number(char** save, const char* what, long* out) {
+    char* line = strtok_r(NULL, "\n", save);
+    char* end;
+    if (line == NULL) {
+        fprintf(stderr, "transfer list is missing %s\n", what);
+        return -1;
+    }
+    *out = strtol(line, &end, 10);
+    if (end == line || *end != '\0' || *out < 0) {
+        fprintf(stderr, "bad %s \"%s\" in transfer list\n", what, line);
+        return -1;
+    }
+    return 0;
+}
+
+int PerformBlockImageUpdate(const char* blockdev, char* transfer_list,
+                            const BlockImageSources* sources) {
+    CommandState cs;
+    memset(&cs, 0, sizeof(cs));
+    cs.sources = sources;
+    cs.fd = -1;
+
+    int result = -1;
+    char* line_save;
+    long version, total;
+    long max_entries = 0, max_blocks = 0;
+
+    char* line = strtok_r(transfer_list, "\n", &line_save);
+    char* end;
+    version = line ? strtol(line, &end, 10) : 0;
+    if (line == NULL || *end != '\0' || (version != 1 && version != 2)) {
+        fprintf(stderr, "unsupported transfer list version \"%s\"\n",
+                line ? line : "");
+        return -1;
+    }
+    cs.version = version;
+    if (parse_header_number(&line_save, "block count", &total) != 0) {
+        return -1;
+    }
+    cs.total = total;
+    if (version >= 2) {
+        if (parse_header_number(&line_save, "stash entry limit",
+                                &max_entries) != 0 ||
+            parse_header_number(&line_save, "stash block limit",
+                                &max_blocks) != 0) {
+            return -1;
+        }
+        cs.max_stash_entries = max_entries;
+        cs.max_stash_blocks = max_blocks;
+        if (max_entries > 0) {
+            cs.stash = calloc(max_entries, sizeof(StashEntry));
+            if (cs.stash == NULL) {
+                fprintf(stderr, "failed to allocate %ld stash entries\n",
+                        max_entries);
+                return -1;
+            }
+        }
+    }
+
+    cs.fd = open(blockdev, O_RDWR);
+    if (cs.fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", blockdev, strerror(errno));
+        goto done;
+    }
+
+    int line_number = version >= 2 ? 4 : 2;
+    while ((line = strtok_r(NULL, "\n", &line_save)) != NULL) {
+        ++line_number;
+        char* word_save;
+        char* cmd = strtok_r(line, " ", &word_save);
+        if (cmd == NULL) continue;
+
+        int r;
+        if (strcmp(cmd, "zero") == 0) {
+            r = PerformCommandZero(&cs, &word_save);
+        } else if (strcmp(cmd, "new") == 0) {
+            r = PerformCommandNew(&cs, &word_save);
+        } else if (strcmp(cmd, "erase") == 0) {
+            r = PerformCommandErase(&cs, &word_save);
+        } else if (strcmp(cmd, "move") == 0) {
+            r = PerformCommandMove(&cs, &word_save);
+        } else if (strcmp(cmd, "bsdiff") == 0 || strcmp(cmd, "imgdiff") == 0) {
+            r = PerformCommandDiff(&cs, cmd, &word_save);
+        } else if (version >= 2 && strcmp(cmd, "stash") == 0) {
+            r = PerformCommandStash(&cs, &word_save);
+        } else if (version >= 2 && strcmp(cmd, "free") == 0) {
+            r = PerformCommandFree(&cs, &word_save);
+        } else {
+            fprintf(stderr, "unknown command \"%s\"\n", cmd);
+            r = -1;
+        }
+        if (r != 0) {
+            fprintf(stderr, "transfer list line %d (%s) failed\n",
+                    line_number, cmd);
+            goto done;
+        }
+    }
+
+    if (fsync(cs.fd) != 0) {
+        fprintf(stderr, "fsync of %s failed: %s\n", blockdev, strerror(errno));
+        goto done;
+    }
+    if (cs.stash_count > 0) {
+        fprintf(stderr, "warning: %d stash entries never freed\n",
+                cs.stash_count);
+    }
+    fprintf(stderr, "wrote %zu blocks to %s; expected %zu\n",
+            cs.written, blockdev, cs.total);
+    result = 0;
+
+  done:
+    if (cs.fd >= 0) close(cs.fd);
+    while (cs.stash_count > 0) free_stash(&cs, cs.stash);
+    free(cs.stash);
+    free(cs.buffer);
+    return result;
+}
+
+int BlockRangeSha1(const char* blockdev, const char* ranges,
+                   uint8_t digest[SHA_DIGEST_SIZE]) {
+    RangeSet* rs = parse_range(ranges);
+    if (rs == NULL) return -1;
+
+    int result = -1;
+    unsigned char* buffer = NULL;
+    int fd = open(blockdev, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", blockdev, strerror(errno));
+        goto done;
+    }
+    buffer = malloc(BLOCK_IO_CHUNK);
+    if (buffer == NULL) goto done;
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        if (seek_block(fd, rs->pos[i*2]) != 0) goto done;
+        uint64_t left = (rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        while (left > 0) {
+            size_t n = left < BLOCK_IO_CHUNK ? (size_t)left : BLOCK_IO_CHUNK;
+            if (read_all(fd, buffer, n) != 0) goto done;
+            SHA_update(&ctx, buffer, n);
+            left -= n;
+        }
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    result = 0;
+
+  done:
+    if (fd >= 0) close(fd);
+    free(buffer);
+    free(rs);
+    return result;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_BLOCKIMG_H_
+#define _UPDATER_BLOCKIMG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/sha.h"
+
+#define BLOCKSIZE 4096
+
+// Fills buf with the next len bytes of the new data stream.  Returns 0
+// on success, or -1 if the stream ended early or couldn't be read.
+typedef int (*BlockNewDataFn)(unsigned char* buf, size_t len, void* cookie);
+
+// Called after each command that writes blocks, with the fraction of
+// the transfer list's blocks written so far.
+typedef void (*BlockProgressFn)(float fraction, void* cookie);
+
+typedef struct {
+    BlockNewDataFn read_new;        // data for "new" commands
+    void* new_cookie;
+    const unsigned char* patch_data;    // what "bsdiff" and "imgdiff"
+    size_t patch_len;                   // offsets refer to
+    BlockProgressFn progress;       // may be NULL
+    void* progress_cookie;
+} BlockImageSources;
+
+// Apply a transfer list to the block device (or image file) at
+// blockdev.  transfer_list is modified.  Returns 0 on success, or -1
+// after printing the reason to stderr.
+//
+// Transfer list format (version 1 or 2):
+//
+//   line 1: version
+//   line 2: total number of blocks written, for progress
+//   line 3: (version 2) most stash entries in use at once
+//   line 4: (version 2) most blocks stashed at once
+//
+// followed by one command per line.  A rangeset is written as a
+// comma-separated count of numbers followed by that many block
+// numbers, taken in pairs as [start, end) ranges: "4,10,12,20,21" is
+// blocks 10, 11 and 20.
+//
+//   zero <rangeset>            write zeros
+//   erase <rangeset>           discard; contents become undefined
+//   new <rangeset>             write the next blocks of the new data
+//   move <tgt> <src>           copy
+//   bsdiff <start> <len> <tgt> <src>
+//   imgdiff <start> <len> <tgt> <src>
+//                              write the result of applying the patch
+//                              at patch_data[start, start+len) to src
+//
+// In version 1 a <tgt> <src> pair is written "<src_rangeset>
+// <tgt_rangeset>".  In version 2 it's "<tgt_rangeset> <src>", where
+// <src> is one of
+//
+//   <blocks> <rangeset>
+//   <blocks> - <id>:<locs> [<id>:<locs> ...]
+//   <blocks> <rangeset> <locs> <id>:<locs> [<id>:<locs> ...]
+//
+// giving the source's size in blocks, the blocks to read from the
+// device, where those go in the source (<locs> is a rangeset of
+// offsets within the source; the default is the start of it), and
+// stashed data to fill in the rest.  Version 2 also has
+//
+//   stash <id> <rangeset>      keep a copy of blocks in memory
+//   free <id>                  drop a stash entry
+int PerformBlockImageUpdate(const char* blockdev, char* transfer_list,
+                            const BlockImageSources* sources);
+
+// Compute the SHA-1 of the blocks in ranges (a rangeset as above) of
+// blockdev.  Returns 0 on success, or -1 after printing the reason to
+// stderr.
+int BlockRangeSha1(const char* blockdev, const char* ranges,
+                   uint8_t digest[SHA_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host-side test of the transfer list engine.  Builds source images in
+// ordinary files, applies transfer lists to them and checks the result
+// against the expected target image.
+//
+//   blockimg_test [work_dir]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/bsdiff.h"
+#include "blockimg.h"
+#include "mincrypt/sha.h"
+
+#define IMAGE_BLOCKS 64
+
+static char work_dir[256] = "/tmp";
+
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    size_t pos;
+} MemoryNewData;
+
+static int read_memory_new_data(unsigned char* buf, size_t len, void* cookie) {
+    MemoryNewData* nd = (MemoryNewData*) cookie;
+    if (len > nd->len - nd->pos) return -1;
+    memcpy(buf, nd->data + nd->pos, len);
+    nd->pos += len;
+    return 0;
+}
+
+static unsigned char* block(unsigned char* image, int b) {
+    return image + (size_t)b * BLOCKSIZE;
+}
+
+static void fill_random(unsigned char* data, size_t len, unsigned int seed) {
+    srand(seed);
+    size_t i;
+    for (i = 0; i < len; ++i) data[i] = rand() & 0xff;
+}
+
+static int write_image(const char* path, const unsigned char* data) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    size_t n = fwrite(data, BLOCKSIZE, IMAGE_BLOCKS, f);
+    fclose(f);
+    return n == IMAGE_BLOCKS ? 0 : -1;
+}
+
+static int read_image(const char* path, unsigned char* data) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    size_t n = fread(data, BLOCKSIZE, IMAGE_BLOCKS, f);
+    fclose(f);
+    return n == IMAGE_BLOCKS ? 0 : -1;
+}
+
+// Append a bsdiff patch turning old into new to *patches, and print
+// "<offset> <length>" for it into where.
+static int make_patch(const unsigned char* old, size_t old_len,
+                      const unsigned char* new, size_t new_len,
+                      unsigned char** patches, size_t* patches_len,
+                      char* where, size_t where_len) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/blockimg_test.patch", work_dir);
+    SuffixArray* suffixes = NULL;
+    int r = bsdiff((u_char*)old, old_len, &suffixes, (u_char*)new, new_len,
+                   path);
+    FreeSuffixArray(suffixes);
+    if (r != 0) return -1;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *patches = realloc(*patches, *patches_len + len);
+    size_t n = fread(*patches + *patches_len, 1, len, f);
+    fclose(f);
+    unlink(path);
+    if (n != (size_t)len) return -1;
+    snprintf(where, where_len, "%zu %ld", *patches_len, len);
+    *patches_len += len;
+    return 0;
+}
+
+// Run transfer_list against a copy of src, and check that blocks
+// [0, check_blocks) then match expected.  expect_ok says whether the
+// update should succeed.
+static void run(const char* desc, const unsigned char* src,
+                const char* transfer_list, const unsigned char* new_data,
+                size_t new_len, const unsigned char* patches,
+                size_t patches_len, const unsigned char* expected,
+                int check_blocks, int expect_ok, int* errors) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/blockimg_test.img", work_dir);
+    if (write_image(path, src) != 0) {
+        printf("%s: can't write %s\n", desc, path);
+        ++*errors;
+        return;
+    }
+
+    MemoryNewData nd = { new_data, new_len, 0 };
+    BlockImageSources sources;
+    memset(&sources, 0, sizeof(sources));
+    sources.read_new = read_memory_new_data;
+    sources.new_cookie = &nd;
+    sources.patch_data = patches;
+    sources.patch_len = patches_len;
+
+    char* list = strdup(transfer_list);
+    int ok = PerformBlockImageUpdate(path, list, &sources) == 0;
+    free(list);
+
+    if (ok != expect_ok) {
+        printf("%s: update %s, expected %s\n", desc,
+               ok ? "succeeded" : "failed", expect_ok ? "success" : "failure");
+        ++*errors;
+    } else if (ok) {
+        unsigned char* result = malloc(IMAGE_BLOCKS * BLOCKSIZE);
+        if (read_image(path, result) != 0 ||
+            memcmp(result, expected, (size_t)check_blocks * BLOCKSIZE) != 0) {
+            printf("%s: image doesn't match target\n", desc);
+            ++*errors;
+        } else {
+            // range_sha1() must agree with a hash of the expected data.
+            char ranges[32];
+            uint8_t digest[SHA_DIGEST_SIZE];
+            uint8_t want[SHA_DIGEST_SIZE];
+            snprintf(ranges, sizeof(ranges), "2,0,%d", check_blocks);
+            SHA_hash(expected, check_blocks * BLOCKSIZE, want);
+            if (BlockRangeSha1(path, ranges, digest) != 0 ||
+                memcmp(digest, want, SHA_DIGEST_SIZE) != 0) {
+                printf("%s: range sha1 mismatch\n", desc);
+                ++*errors;
+            }
+        }
+        free(result);
+    }
+    printf(".");
+    fflush(stdout);
+    unlink(path);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        snprintf(work_dir, sizeof(work_dir), "%s", argv[1]);
+    }
+
+    int errors = 0;
+    size_t image_size = IMAGE_BLOCKS * BLOCKSIZE;
+    unsigned char* src = malloc(image_size);
+    unsigned char* tgt = malloc(image_size);
+    unsigned char* new_data = malloc(8 * BLOCKSIZE);
+    fill_random(src, image_size, 1);
+    fill_random(new_data, 8 * BLOCKSIZE, 2);
+    memcpy(tgt, src, image_size);
+
+    unsigned char* patches = NULL;
+    size_t patches_len = 0;
+    char patch1[64], patch2[64], patch3[64];
+
+    // 0-3: zero; 4-11: new data.
+    memset(block(tgt, 0), 0, 4 * BLOCKSIZE);
+    memcpy(block(tgt, 4), new_data, 8 * BLOCKSIZE);
+
+    // 12-19 and 20-27 swap places, which needs a stash.
+    memcpy(block(tgt, 12), block(src, 20), 8 * BLOCKSIZE);
+    memcpy(block(tgt, 20), block(src, 12), 8 * BLOCKSIZE);
+
+    // 28-43: an edited copy of itself.
+    int i;
+    for (i = 0; i < 16 * BLOCKSIZE; i += 1000) {
+        block(tgt, 28)[i] ^= 0x5a;
+    }
+    memmove(block(tgt, 28) + 5000, block(tgt, 28) + 4000, 3 * BLOCKSIZE);
+
+    // 44-51: an edited copy of itself, with half the source coming
+    // from a stash.
+    memset(block(tgt, 44) + 100, 'x', 2000);
+
+    // 52-63 are erased, so their contents aren't checked.
+
+    if (make_patch(block(src, 28), 16 * BLOCKSIZE, block(tgt, 28),
+                   16 * BLOCKSIZE, &patches, &patches_len,
+                   patch1, sizeof(patch1)) != 0 ||
+        make_patch(block(src, 44), 8 * BLOCKSIZE, block(tgt, 44),
+                   8 * BLOCKSIZE, &patches, &patches_len,
+                   patch2, sizeof(patch2)) != 0 ||
+        make_patch(block(src, 28), 16 * BLOCKSIZE, block(tgt, 28),
+                   16 * BLOCKSIZE, &patches, &patches_len,
+                   patch3, sizeof(patch3)) != 0) {
+        printf("failed to make patches\n");
+        return 1;
+    }
+
+    char list[2048];
+    snprintf(list, sizeof(list),
+             "2\n"
+             "52\n"
+             "2\n"
+             "12\n"
+             "zero 2,0,4\n"
+             "new 2,4,12\n"
+             "stash a 2,12,20\n"
+             "move 2,12,20 8 2,20,28\n"
+             "move 2,20,28 8 - a:2,0,8\n"
+             "free a\n"
+             "bsdiff %s 2,28,44 16 2,28,44\n"
+             "stash b 2,44,48\n"
+             "bsdiff %s 2,44,52 8 2,48,52 2,4,8 b:2,0,4\n"
+             "free b\n"
+             "erase 2,52,64\n",
+             patch1, patch2);
+    run("version 2", src, list, new_data, 8 * BLOCKSIZE, patches,
+        patches_len, tgt, 52, 1, &errors);
+
+    // Version 1 has no stash, and gives the source before the target.
+    unsigned char* tgt1 = malloc(image_size);
+    memcpy(tgt1, src, image_size);
+    memcpy(block(tgt1, 0), block(src, 32), 4 * BLOCKSIZE);
+    memcpy(block(tgt1, 8), block(tgt, 28), 16 * BLOCKSIZE);
+    snprintf(list, sizeof(list),
+             "1\n"
+             "20\n"
+             "move 2,32,36 2,0,4\n"
+             "bsdiff %s 2,28,44 4,8,16,16,24\n",
+             patch3);
+    run("version 1", src, list, NULL, 0, patches, patches_len,
+        tgt1, IMAGE_BLOCKS, 1, &errors);
+
+    // Things that must fail cleanly.
+    run("bad version", src, "3\n0\n", NULL, 0, NULL, 0,
+        src, 0, 0, &errors);
+    run("bad range", src, "1\n1\nzero 3,0,1,2\n", NULL, 0, NULL, 0,
+        src, 0, 0, &errors);
+    run("reversed range", src, "1\n1\nzero 2,5,4\n", NULL, 0, NULL, 0,
+        src, 0, 0, &errors);
+    run("past end of image", src, "1\n4\nmove 2,62,66 2,0,4\n", NULL, 0,
+        NULL, 0, src, 0, 0, &errors);
+    run("short new data", src, "1\n8\nnew 2,0,8\n", new_data, BLOCKSIZE,
+        NULL, 0, src, 0, 0, &errors);
+    run("unknown command", src, "2\n0\n0\n0\nfrobnicate 2,0,1\n", NULL, 0,
+        NULL, 0, src, 0, 0, &errors);
+    run("stash limit", src, "2\n0\n1\n2\nstash a 2,0,3\n", NULL, 0,
+        NULL, 0, src, 0, 0, &errors);
+    run("missing stash", src, "2\n4\n0\n0\nmove 2,0,4 4 - a:2,0,4\n", NULL, 0,
+        NULL, 0, src, 0, 0, &errors);
+    run("patch outside data", src, "1\n4\nbsdiff 0 100 2,0,4 2,0,4\n", NULL, 0,
+        patches, 10, src, 0, 0, &errors);
+
+    printf("\n");
+    free(src);
+    free(tgt);
+    free(tgt1);
+    free(new_data);
+    free(patches);
+
+    if (errors == 0) {
+        printf("PASS\n");
+        return 0;
+    }
+    printf("FAIL (%d errors)\n", errors);
+    return 1;
+}
@@ -16,10 +16,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <libgen.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -28,11 +30,11 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
@@ -41,8 +43,10 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "flashutils/flashutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
+#include "blockimg.h"
 
 #include <dirent.h>
 
@@ -370,8 +374,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
     int sec = strtol(sec_str, NULL, 10);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    UpdaterShowProgress((UpdaterInfo*)(state->cookie), frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -388,8 +391,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     double frac = strtod(frac_str, NULL);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    UpdaterSetProgress((UpdaterInfo*)(state->cookie), frac);
 
     return StringValue(frac_str);
 }
@@ -412,17 +414,71 @@ Value* PackageExtractDirFn(const char* name, State* state,
     bool success = mzExtractRecursive(za, zip_path, dest_path,
                                       MZ_EXTRACT_FILES_ONLY, &timestamp,
                                       NULL, NULL, sehandle);
+    UpdaterNoteWritten((UpdaterInfo*)(state->cookie), dest_path);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
 }
 
+// A blob holding a file from the package.  Stored files use the bytes
+// in the package mapping directly; compressed ones are inflated the
+// first time they're loaded, so a patch that apply_patch() turns out
+// not to need is never inflated at all.
+typedef struct {
+    Value value;        // must be first; see ValueBacking
+    ZipArchive* za;
+    const ZipEntry* entry;
+} PackageBlob;
+
+static void load_package_blob(Value* v) {
+    PackageBlob* blob = (PackageBlob*) v;
+    char* data = malloc(v->size);
+    if (data == NULL ||
+        !mzExtractZipEntryToBuffer(blob->za, blob->entry,
+                                   (unsigned char*) data)) {
+        fprintf(stderr, "failed to extract %.*s from package\n",
+                blob->entry->fileNameLen, blob->entry->fileName);
+        free(data);
+        v->size = -1;
+        return;
+    }
+    v->data = data;
+}
+
+static void release_stored_blob(Value* v) {
+    // data belongs to the package mapping.
+}
+
+static void release_inflated_blob(Value* v) {
+    free(v->data);
+}
+
+static const ValueBacking kStoredBlob = {
+    NULL, release_stored_blob
+};
+
+static const ValueBacking kInflatedBlob = {
+    load_package_blob, release_inflated_blob
+};
+
+static Value* package_blob(ZipArchive* za, const ZipEntry* entry) {
+    PackageBlob* blob = malloc(sizeof(PackageBlob));
+    blob->za = za;
+    blob->entry = entry;
+    blob->value.type = VAL_BLOB;
+    blob->value.size = mzGetZipEntryUncompLen(entry);
+    blob->value.data = (char*) mzGetStoredZipEntryData(za, entry);
+    blob->value.backing =
+        blob->value.data != NULL ? &kStoredBlob : &kInflatedBlob;
+    return &blob->value;
+}
 
 // package_extract_file(package_path, destination_path)
 //   or
 // package_extract_file(package_path)
 //   to return the entire contents of the file as the result of this
-//   function (the char* returned is actually a FileContents*).
+//   function.  The contents aren't copied out of the package unless
+//   the file is compressed, and then not until they're used.
 Value* PackageExtractFileFn(const char* name, State* state,
                            int argc, Expr* argv[]) {
     if (argc != 1 && argc != 2) {
@@ -452,6 +508,9 @@ Value* PackageExtractFileFn(const char* name, State* state,
         }
         success = mzExtractZipEntryToFile(za, entry, fileno(f));
         fclose(f);
+        char* dir = strdup(dest_path);
+        UpdaterNoteWritten((UpdaterInfo*)(state->cookie), dirname(dir));
+        free(dir);
 
       done2:
         free(zip_path);
@@ -462,38 +521,22 @@ Value* PackageExtractFileFn(const char* name, State* state,
         // as the result.
 
         char* zip_path;
-        Value* v = malloc(sizeof(Value));
-        v->type = VAL_BLOB;
-        v->size = -1;
-        v->data = NULL;
-
         if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
 
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+        Value* v;
         if (entry == NULL) {
             fprintf(stderr, "%s: no %s in package\n", name, zip_path);
-            goto done1;
-        }
-
-        v->size = mzGetZipEntryUncompLen(entry);
-        v->data = malloc(v->size);
-        if (v->data == NULL) {
-            fprintf(stderr, "%s: failed to allocate %ld bytes for %s\n",
-                    name, (long)v->size, zip_path);
-            goto done1;
-        }
-
-        success = mzExtractZipEntryToBuffer(za, entry,
-                                            (unsigned char *)v->data);
-
-      done1:
-        free(zip_path);
-        if (!success) {
-            free(v->data);
-            v->data = NULL;
+            v = malloc(sizeof(Value));
+            v->type = VAL_BLOB;
             v->size = -1;
+            v->data = NULL;
+            v->backing = NULL;
+        } else {
+            v = package_blob(za, entry);
         }
+        free(zip_path);
         return v;
     }
 }
@@ -748,10 +791,12 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
             }
             continue;
         }
-        if (max_warnings != 0) {
-            printf("ParsedPermArgs: unknown key \"%s\", ignoring\n", args[i]);
-            max_warnings--;
-            if (max_warnings == 0) {
+        if (max_warnings > 0) {
+            int left = __sync_sub_and_fetch(&max_warnings, 1);
+            if (left >= 0) {
+                printf("ParsedPermArgs: unknown key \"%s\", ignoring\n", args[i]);
+            }
+            if (left == 0) {
                 printf("ParsedPermArgs: suppressing further warnings\n");
             }
         }
@@ -759,6 +804,20 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     return parsed;
 }
 
+// Whether filename's SELinux label is already label.
+static bool label_matches(const char* filename, const char* label) {
+    char current[256];
+    ssize_t len = lgetxattr(filename, XATTR_NAME_SELINUX,
+                            current, sizeof(current) - 1);
+    if (len <= 0) return false;
+    current[len] = '\0';
+    return strcmp(current, label) == 0;
+}
+
+// Apply parsed to filename, whose current state is in statptr.  Only
+// values that differ from what the file already has are written, so
+// re-running a script over an unchanged tree costs one lstat and a
+// getxattr or two per file.
 static int ApplyParsedPerms(
         const char* filename,
         const struct stat *statptr,
@@ -771,47 +830,46 @@ static int ApplyParsedPerms(
         return 0;
     }
 
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                   filename, parsed.uid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                   filename, parsed.gid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.mode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.dmode, strerror(errno));
+    // chown() clears setuid/setgid bits and file capabilities, so
+    // after changing the owner those are written regardless.
+    bool owner_changed = false;
+    uid_t uid = (parsed.has_uid && statptr->st_uid != parsed.uid) ?
+            parsed.uid : (uid_t) -1;
+    gid_t gid = (parsed.has_gid && statptr->st_gid != parsed.gid) ?
+            parsed.gid : (gid_t) -1;
+    if (uid != (uid_t) -1 || gid != (gid_t) -1) {
+        if (chown(filename, uid, gid) < 0) {
+            printf("ApplyParsedPerms: chown of %s to %d:%d failed: %s\n",
+                   filename, (int) uid, (int) gid, strerror(errno));
             bad++;
+        } else {
+            owner_changed = true;
         }
     }
 
+    // fmode and dmode take precedence over mode for files and
+    // directories.
+    bool has_mode = true;
+    mode_t mode = 0;
     if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
+        mode = parsed.fmode;
+    } else if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
+        mode = parsed.dmode;
+    } else if (parsed.has_mode) {
+        mode = parsed.mode;
+    } else {
+        has_mode = false;
+    }
+    if (has_mode &&
+        (owner_changed || (statptr->st_mode & 07777) != (mode & 07777))) {
+        if (chmod(filename, mode) < 0) {
             printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
+                   filename, mode, strerror(errno));
             bad++;
         }
     }
 
-    if (parsed.has_selabel) {
+    if (parsed.has_selabel && !label_matches(filename, parsed.selabel)) {
         // TODO: Don't silently ignore ENOTSUP
         if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
             printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
@@ -821,8 +879,13 @@ static int ApplyParsedPerms(
     }
 
     if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
+        struct vfs_cap_data current;
+        ssize_t len = getxattr(filename, XATTR_NAME_CAPS,
+                               &current, sizeof(current));
         if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
+            if (owner_changed || (len < 0 && errno == ENODATA)) {
+                // Nothing to remove.
+            } else if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
@@ -840,7 +903,10 @@ static int ApplyParsedPerms(
             cap_data.data[0].inheritable = 0;
             cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
             cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
+            if (!owner_changed && len == sizeof(cap_data) &&
+                memcmp(&current, &cap_data, sizeof(cap_data)) == 0) {
+                // Already set.
+            } else if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
@@ -855,19 +921,234 @@ static int ApplyParsedPerms(
     return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
+// set_metadata_recursive walks the tree on several threads.  Each
+// thread keeps its own queue of directories still to be read, takes
+// work from the back of it (depth first) and, when it runs dry, steals
+// from the front of another thread's queue, where the biggest untouched
+// subtrees are.  As with nftw(FTW_DEPTH), a directory's own metadata is
+// applied only after everything under it is done.
+
+#define METADATA_THREADS 4
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
+typedef struct MetadataDir {
+    char* path;
+    struct stat st;
+    struct MetadataDir* parent;
+    // Subdirectories not yet finished, plus one while this directory's
+    // entries are being read.
+    int pending;
+} MetadataDir;
+
+typedef struct {
+    pthread_mutex_t lock;
+    MetadataDir** items;
+    int head;
+    int tail;
+    int capacity;
+} MetadataQueue;
+
+typedef struct {
+    struct perm_parsed_args parsed;
+    MetadataQueue queues[METADATA_THREADS];
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int queued;         // directories sitting in some queue
+    int busy;           // threads reading a directory
+    int bad;            // failures, updated atomically
+} MetadataWalk;
+
+typedef struct {
+    MetadataWalk* walk;
+    int index;
+} MetadataWorker;
+
+static void metadata_push(MetadataWalk* walk, int index, MetadataDir* dir) {
+    MetadataQueue* q = walk->queues + index;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        // Slide the live items down, or grow.
+        if (q->head > q->capacity / 2) {
+            memmove(q->items, q->items + q->head,
+                    (q->tail - q->head) * sizeof(MetadataDir*));
+        } else {
+            q->capacity = q->capacity ? q->capacity * 2 : 64;
+            q->items = realloc(q->items, q->capacity * sizeof(MetadataDir*));
+            memmove(q->items, q->items + q->head,
+                    (q->tail - q->head) * sizeof(MetadataDir*));
+        }
+        q->tail -= q->head;
+        q->head = 0;
+    }
+    q->items[q->tail++] = dir;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&walk->idle_lock);
+    walk->queued++;
+    pthread_cond_signal(&walk->idle_cond);
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// Take a directory from the back of our own queue, or steal one from
+// the front of someone else's.
+static MetadataDir* metadata_take(MetadataWalk* walk, int index) {
+    MetadataDir* dir = NULL;
+    int i;
+    for (i = 0; i < METADATA_THREADS && dir == NULL; ++i) {
+        MetadataQueue* q = walk->queues + (index + i) % METADATA_THREADS;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            dir = (i == 0) ? q->items[--q->tail] : q->items[q->head++];
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return dir;
+}
+
+// One of dir's subdirectories (or dir's own entries) is done.  When
+// nothing under dir is left, apply its metadata and tell its parent.
+static void metadata_finish(MetadataWalk* walk, MetadataDir* dir) {
+    while (dir != NULL && __sync_sub_and_fetch(&dir->pending, 1) == 0) {
+        int bad = ApplyParsedPerms(dir->path, &dir->st, walk->parsed);
+        if (bad) __sync_fetch_and_add(&walk->bad, bad);
+        MetadataDir* parent = dir->parent;
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static void metadata_read_dir(MetadataWalk* walk, int index,
+                              MetadataDir* dir) {
+    int bad = 0;
+    DIR* d = opendir(dir->path);
+    if (d == NULL) {
+        printf("set_metadata_recursive: can't open %s: %s\n",
+               dir->path, strerror(errno));
+        bad++;
+    } else {
+        size_t dir_len = strlen(dir->path);
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            size_t path_len = dir_len + 1 + strlen(de->d_name) + 1;
+            char* path = malloc(path_len);
+            snprintf(path, path_len, "%s/%s", dir->path, de->d_name);
+
+            struct stat st;
+            if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                printf("set_metadata_recursive: can't stat %s: %s\n",
+                       path, strerror(errno));
+                bad++;
+                free(path);
+            } else if (S_ISDIR(st.st_mode)) {
+                MetadataDir* child = malloc(sizeof(MetadataDir));
+                child->path = path;
+                child->st = st;
+                child->parent = dir;
+                child->pending = 1;
+                __sync_fetch_and_add(&dir->pending, 1);
+                metadata_push(walk, index, child);
+            } else {
+                bad += ApplyParsedPerms(path, &st, walk->parsed);
+                free(path);
+            }
+        }
+        closedir(d);
+    }
+    if (bad) __sync_fetch_and_add(&walk->bad, bad);
+    metadata_finish(walk, dir);
+}
+
+static void* metadata_worker(void* cookie) {
+    MetadataWorker* worker = (MetadataWorker*) cookie;
+    MetadataWalk* walk = worker->walk;
+
+    while (true) {
+        MetadataDir* dir = metadata_take(walk, worker->index);
+        pthread_mutex_lock(&walk->idle_lock);
+        if (dir != NULL) {
+            walk->queued--;
+            walk->busy++;
+            pthread_mutex_unlock(&walk->idle_lock);
+
+            metadata_read_dir(walk, worker->index, dir);
+
+            pthread_mutex_lock(&walk->idle_lock);
+            walk->busy--;
+            if (walk->busy == 0 && walk->queued == 0) {
+                pthread_cond_broadcast(&walk->idle_cond);
+            }
+            pthread_mutex_unlock(&walk->idle_lock);
+            continue;
+        }
+        // Nothing to take.  Wait for a push, unless nobody is left
+        // who could push anything.
+        while (walk->queued == 0 && walk->busy > 0) {
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+        }
+        bool done = (walk->queued == 0 && walk->busy == 0);
+        pthread_mutex_unlock(&walk->idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+// Apply parsed to the tree rooted at the directory path.  Returns the
+// number of failures.
+static int SetMetadataRecursive(const char* path, const struct stat* st,
+                                struct perm_parsed_args parsed) {
+    MetadataWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.parsed = parsed;
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.idle_cond, NULL);
+    int i;
+    for (i = 0; i < METADATA_THREADS; ++i) {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+    }
+
+    MetadataDir* root = malloc(sizeof(MetadataDir));
+    root->path = strdup(path);
+    root->st = *st;
+    root->parent = NULL;
+    root->pending = 1;
+    metadata_push(&walk, 0, root);
+
+    pthread_t threads[METADATA_THREADS];
+    MetadataWorker workers[METADATA_THREADS];
+    int started = 1;
+    for (i = 0; i < METADATA_THREADS; ++i) {
+        workers[i].walk = &walk;
+        workers[i].index = i;
+    }
+    for (i = 1; i < METADATA_THREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, metadata_worker,
+                           &workers[i]) != 0) {
+            break;
+        }
+        ++started;
+    }
+    // Any queue is reachable by stealing, so fewer threads is fine.
+    metadata_worker(&workers[0]);
+    for (i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < METADATA_THREADS; ++i) {
+        free(walk.queues[i].items);
+        pthread_mutex_destroy(&walk.queues[i].lock);
+    }
+    pthread_cond_destroy(&walk.idle_cond);
+    pthread_mutex_destroy(&walk.idle_lock);
+    return walk.bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     int bad = 0;
-    static int nwarnings = 0;
     struct stat sb;
     Value* result = NULL;
 
@@ -888,10 +1169,8 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
 
     struct perm_parsed_args parsed = ParsePermArgs(argc, args);
 
-    if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
+    if (recursive && S_ISDIR(sb.st_mode)) {
+        bad += SetMetadataRecursive(args[0], &sb, parsed);
     } else {
         bad += ApplyParsedPerms(args[0], &sb, parsed);
     }
@@ -981,8 +1260,11 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fclose(f);
 
-    char* line = strtok(buffer, "\n");
-    do {
+    // strtok_r(), not strtok(): file_getprop may run inside parallel().
+    char* save;
+    char* line;
+    for (line = strtok_r(buffer, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
         // skip whitespace at start of line
         while (*line && isspace(*line)) ++line;
 
@@ -1015,8 +1297,7 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
         result = strdup(val_start);
         break;
-
-    } while ((line = strtok(NULL, "\n")));
+    }
 
     if (result == NULL) result = strdup("");
 
@@ -1028,15 +1309,222 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+static char* PrintSha1(uint8_t* digest);
+
+// Where write_raw_image sends an image it streams: an MTD write
+// context, or a file descriptor for eMMC partitions and devices and
+// for regular files.
+typedef struct {
+    const MtdPartition* mtd_partition;
+    MtdWriteContext* mtd;
+    int fd;
+    char device[PATH_MAX];
+    SHA_CTX sha_ctx;
+    size_t written;
+} RawImageWriter;
+
 static bool write_raw_image_cb(const unsigned char* data,
                                int data_len, void* ctx) {
-    int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
-    if (r == data_len) return true;
-    fprintf(stderr, "%s\n", strerror(errno));
-    return false;
+    RawImageWriter* w = (RawImageWriter*) ctx;
+    ssize_t r;
+    if (w->mtd != NULL) {
+        r = mtd_write_data(w->mtd, (const char *)data, data_len);
+    } else {
+        r = 0;
+        while (r < data_len) {
+            ssize_t n = TEMP_FAILURE_RETRY(write(w->fd, data + r, data_len - r));
+            if (n <= 0) break;
+            r += n;
+        }
+    }
+    if (r != data_len) {
+        fprintf(stderr, "writing %s: %s\n", w->device, strerror(errno));
+        return false;
+    }
+    SHA_update(&w->sha_ctx, data, data_len);
+    w->written += data_len;
+    return true;
+}
+
+// Open the MTD partition behind an MTD partition name or device path
+// (/dev/block/mtdblockN, /dev/mtd/mtdN) for writing.
+static int open_mtd_image_writer(const char* partition, RawImageWriter* w) {
+    mtd_scan_partitions();
+    if (partition[0] == '/') {
+        const char* digits = partition + strlen(partition);
+        while (digits > partition && isdigit(digits[-1])) --digits;
+        if (*digits != '\0') {
+            w->mtd_partition = mtd_find_partition_by_device_index(atoi(digits));
+        }
+    } else {
+        w->mtd_partition = mtd_find_partition_by_name(partition);
+    }
+    if (w->mtd_partition == NULL) {
+        fprintf(stderr, "no mtd partition \"%s\"\n", partition);
+        return -1;
+    }
+    w->mtd = mtd_write_partition(w->mtd_partition);
+    if (w->mtd == NULL) {
+        fprintf(stderr, "can't write mtd partition \"%s\"\n", partition);
+        return -1;
+    }
+    snprintf(w->device, sizeof(w->device), "%s", partition);
+    return 0;
+}
+
+// Returns 0 if the image can be streamed to partition, 1 if it has to
+// go through a file and restore_raw_partition() (BML, which needs its
+// partitions unlocked first), or -1 on error.  Device paths get the
+// same flash type detection as restore_raw_partition(); only regular
+// files, eMMC partitions and eMMC devices are written with write().
+static int open_raw_image_writer(const char* partition, RawImageWriter* w) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    SHA_init(&w->sha_ctx);
+
+    struct stat st;
+    if (partition[0] == '/' && stat(partition, &st) == 0 &&
+        S_ISREG(st.st_mode)) {
+        snprintf(w->device, sizeof(w->device), "%s", partition);
+    } else {
+        switch (detect_partition(NULL, partition)) {
+            case MTD:
+                return open_mtd_image_writer(partition, w);
+            case BML:
+                return 1;
+            case MMC:
+                if (partition[0] == '/') {
+                    snprintf(w->device, sizeof(w->device), "%s", partition);
+                } else if (get_partition_device(partition, w->device) != 0) {
+                    fprintf(stderr, "no emmc partition named \"%s\"\n",
+                            partition);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "can't tell the flash type of \"%s\"\n",
+                        partition);
+                return -1;
+        }
+    }
+    w->fd = open(w->device, O_WRONLY);
+    if (w->fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", w->device, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int close_raw_image_writer(RawImageWriter* w) {
+    int result = 0;
+    if (w->mtd != NULL) {
+        if (mtd_erase_blocks(w->mtd, -1) == -1) {
+            fprintf(stderr, "error erasing blocks of %s\n", w->device);
+            result = -1;
+        }
+        if (mtd_write_close(w->mtd) != 0) {
+            fprintf(stderr, "error closing write of %s\n", w->device);
+            result = -1;
+        }
+        w->mtd = NULL;
+    } else if (w->fd >= 0) {
+        if (fsync(w->fd) != 0) {
+            fprintf(stderr, "fsync of %s failed: %s\n",
+                    w->device, strerror(errno));
+            result = -1;
+        }
+        // Drop the now-clean pages so the read back comes from flash.
+        posix_fadvise(w->fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(w->fd);
+        w->fd = -1;
+    }
+    return result;
 }
 
-// write_raw_image(filename_or_blob, partition)
+// Read back what was written and compare it with the hash taken while
+// writing.
+static int verify_raw_image(RawImageWriter* w, const uint8_t* digest) {
+    MtdReadContext* mtd = NULL;
+    int fd = -1;
+    if (w->mtd_partition != NULL) {
+        mtd = mtd_read_partition(w->mtd_partition);
+        if (mtd == NULL) {
+            fprintf(stderr, "can't read back %s\n", w->device);
+            return -1;
+        }
+    } else {
+        fd = open(w->device, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "can't read back %s: %s\n",
+                    w->device, strerror(errno));
+            return -1;
+        }
+    }
+
+    int result = -1;
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    size_t left = w->written;
+    char* buffer = malloc(64 * 1024);
+    while (buffer != NULL && left > 0) {
+        size_t n = left < 64 * 1024 ? left : 64 * 1024;
+        ssize_t r = mtd ? mtd_read_data(mtd, buffer, n)
+                        : TEMP_FAILURE_RETRY(read(fd, buffer, n));
+        if (r <= 0) {
+            fprintf(stderr, "short read back of %s\n", w->device);
+            goto done;
+        }
+        SHA_update(&ctx, buffer, r);
+        left -= r;
+    }
+    if (buffer != NULL) {
+        if (memcmp(SHA_final(&ctx), digest, SHA_DIGEST_SIZE) != 0) {
+            fprintf(stderr, "%s doesn't match what was written\n", w->device);
+        } else {
+            result = 0;
+        }
+    }
+
+  done:
+    free(buffer);
+    if (mtd != NULL) mtd_read_close(mtd);
+    if (fd >= 0) close(fd);
+    return result;
+}
+
+// Write contents to a temp file and flash that with
+// restore_raw_partition(), for flash types that can't be streamed to.
+static int write_raw_image_via_file(ZipArchive* za, const ZipEntry* entry,
+                                    const Value* contents,
+                                    const char* partition) {
+    const char* tmp = "/tmp/write_raw_image.tmp";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "can't create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    RawImageWriter w;
+    memset(&w, 0, sizeof(w));
+    w.fd = fd;
+    snprintf(w.device, sizeof(w.device), "%s", tmp);
+    SHA_init(&w.sha_ctx);
+    bool ok = entry ? mzProcessZipEntryContents(za, entry,
+                                                write_raw_image_cb, &w)
+                    : write_raw_image_cb((const unsigned char*)contents->data,
+                                         contents->size, &w);
+    close(fd);
+    int result = (ok && restore_raw_partition(NULL, partition, tmp) == 0) ?
+            0 : -1;
+    unlink(tmp);
+    return result;
+}
+
+// write_raw_image(contents, partition)
+//   contents is the name of a file in the package, a blob (as returned
+//   by package_extract_file()), or the absolute path of a file.
+//   Package entries and blobs are written straight to the partition
+//   (an MTD or eMMC partition name, or a device path) and read back
+//   to check them.  Returns the partition on success, "" on failure.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
@@ -1059,17 +1547,60 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         ErrorAbort(state, "file argument to %s can't be empty", name);
         goto done;
     }
+    if (contents->type == VAL_BLOB && contents->size < 0) {
+        ErrorAbort(state, "%s(): no file contents received", name);
+        goto done;
+    }
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = NULL;
+    if (contents->type == VAL_STRING) {
+        if (contents->data[0] != '/') {
+            entry = mzFindZipEntry(za, contents->data);
+        }
+        if (entry == NULL) {
+            // A file on disk; restore_raw_partition() copies it.
+            char* filename = contents->data;
+            result = strdup(restore_raw_partition(NULL, partition,
+                                                  filename) == 0 ?
+                            partition : "");
+            goto done;
+        }
+    }
 
-    char* filename = contents->data;
-    if (0 == restore_raw_partition(NULL, partition, filename))
-        result = strdup(partition);
-    else {
+    RawImageWriter w;
+    int r = open_raw_image_writer(partition, &w);
+    if (r == 1) {
+        r = write_raw_image_via_file(za, entry, contents, partition);
+        result = strdup(r == 0 ? partition : "");
+        goto done;
+    }
+    if (r < 0) {
         result = strdup("");
         goto done;
     }
 
+    bool ok;
+    if (entry != NULL) {
+        ok = mzProcessZipEntryContents(za, entry, write_raw_image_cb, &w);
+    } else {
+        ok = write_raw_image_cb((const unsigned char*)contents->data,
+                                contents->size, &w);
+    }
+    if (close_raw_image_writer(&w) != 0) ok = false;
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    memcpy(digest, SHA_final(&w.sha_ctx), SHA_DIGEST_SIZE);
+    if (ok && verify_raw_image(&w, digest) != 0) ok = false;
+
+    char* hex = PrintSha1(digest);
+    fprintf(stderr, "%s %zu bytes to %s (sha1 %s)\n",
+            ok ? "wrote" : "failed to write", w.written, partition, hex);
+    free(hex);
+    result = strdup(ok ? partition : "");
+
 done:
-    if (result != partition) FreeValue(partition_value);
+    FreeValue(partition_value);
     FreeValue(contents);
     return StringValue(result);
 }
@@ -1116,12 +1647,8 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     /* Skip files listed in the backup table */
     for (i=0; i<totalbaks; i++) {
         if (!strncmp(source_filename, bakfiles[i],PATH_MAX)) {
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print Skipping update of modified file %s\n", source_filename);
-            /* the command pipe tokenizes on \n, so issue an empty ui_print
-               to do the real line break */
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print\n");
+            UpdaterPrint((UpdaterInfo*)(state->cookie),
+                "Skipping update of modified file %s", source_filename);
             return StringValue(strdup("t"));
         }
     }
@@ -1139,7 +1666,21 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     int patchcount = (argc-4) / 2;
-    Value** patches = ReadValueVarArgs(state, argc-4, argv+4);
+    // Patches are evaluated but not loaded: applypatch() loads only
+    // the one it uses, if any.
+    Value** patches = malloc((argc-4) * sizeof(Value*));
+    for (i = 0; i < argc-4; ++i) {
+        patches[i] = EvaluateValue(state, argv[4+i]);
+        if (patches[i] == NULL) {
+            while (--i >= 0) FreeValue(patches[i]);
+            free(patches);
+            free(source_filename);
+            free(target_filename);
+            free(target_sha1);
+            free(target_size_str);
+            return NULL;
+        }
+    }
 
     for (i = 0; i < patchcount; ++i) {
         if (patches[i*2]->type != VAL_STRING) {
@@ -1225,6 +1766,194 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+#define PATCH_CHECK_THREADS 4
+
+typedef struct {
+    char* filename;
+    char** sha1s;
+    int num_sha1s;
+    int result;         // as for applypatch_check()
+} PatchCheckEntry;
+
+typedef struct {
+    PatchCheckEntry* entries;
+    int count;
+    volatile int next;
+} PatchCheckBatch;
+
+static bool is_partition_spec(const char* filename) {
+    return strncmp(filename, "MTD:", 4) == 0 ||
+           strncmp(filename, "EMMC:", 5) == 0;
+}
+
+// Checks files (but not partitions, whose loading isn't thread-safe)
+// against their own sha1s.  The cache copy is checked afterwards.
+static void* patch_check_worker(void* cookie) {
+    PatchCheckBatch* batch = (PatchCheckBatch*) cookie;
+    int i;
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < batch->count) {
+        PatchCheckEntry* e = batch->entries + i;
+        if (is_partition_spec(e->filename)) continue;
+        FileContents file;
+        int r = MapFileContents(e->filename, &file, RETOUCH_DO_MASK);
+        if (r == 0) {
+            if (e->num_sha1s == 0 ||
+                FindMatchingPatch(file.sha1, e->sha1s, e->num_sha1s) >= 0) {
+                e->result = 0;
+            } else {
+                e->result = 1;
+            }
+            FreeFileContents(&file);
+        } else {
+            e->result = (r == -ENOENT) ? -ENOENT : 1;
+        }
+    }
+    return NULL;
+}
+
+// Parse a manifest into entries; returns the number of entries.  The
+// strings point into manifest, which is modified.
+static int parse_patch_check_manifest(char* manifest,
+                                      PatchCheckEntry** entries) {
+    int count = 0;
+    int allocated = 0;
+    *entries = NULL;
+    char* line_save;
+    char* line;
+    for (line = strtok_r(manifest, "\n", &line_save); line != NULL;
+         line = strtok_r(NULL, "\n", &line_save)) {
+        char* word_save;
+        char* filename = strtok_r(line, " \t\r", &word_save);
+        if (filename == NULL || filename[0] == '#') continue;
+        if (count == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            *entries = realloc(*entries, allocated * sizeof(PatchCheckEntry));
+        }
+        PatchCheckEntry* e = *entries + count++;
+        e->filename = filename;
+        e->sha1s = NULL;
+        e->num_sha1s = 0;
+        e->result = 1;
+        char* sha1;
+        while ((sha1 = strtok_r(NULL, " \t\r", &word_save)) != NULL) {
+            e->sha1s = realloc(e->sha1s, (e->num_sha1s + 1) * sizeof(char*));
+            e->sha1s[e->num_sha1s++] = sha1;
+        }
+    }
+    return count;
+}
+
+// apply_patch_check_batch(manifest)
+//    Does apply_patch_check() for every line of manifest (a string or
+//    blob), where each line is "<file> [<sha1> ...]".  Files are hashed
+//    on several threads at once, and the cache copy is only read once.
+//    Returns the files that failed the check, one per line, so ""
+//    means that everything passed:
+//
+//      apply_patch_check_batch(package_extract_file("check.list")) == "" ||
+//          abort("some files can't be patched");
+Value* ApplyPatchCheckBatchFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    Value* manifest_value;
+    if (ReadValueArgs(state, argv, 1, &manifest_value) < 0) {
+        return NULL;
+    }
+    if (manifest_value->size < 0) {
+        FreeValue(manifest_value);
+        return ErrorAbort(state, "%s(): no manifest contents", name);
+    }
+    char* manifest = malloc(manifest_value->size + 1);
+    memcpy(manifest, manifest_value->data, manifest_value->size);
+    manifest[manifest_value->size] = '\0';
+    FreeValue(manifest_value);
+
+    PatchCheckBatch batch;
+    batch.count = parse_patch_check_manifest(manifest, &batch.entries);
+    batch.next = 0;
+
+    int i;
+    pthread_t threads[PATCH_CHECK_THREADS];
+    int started = 1;
+    for (i = 1; i < PATCH_CHECK_THREADS && i < batch.count; ++i) {
+        if (pthread_create(&threads[i], NULL, patch_check_worker,
+                           &batch) != 0) {
+            break;
+        }
+        ++started;
+    }
+    patch_check_worker(&batch);
+    for (i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    FileContents cache;
+    int cache_state = 1;        // 1 = not loaded yet
+    size_t failed_len = 0;
+    int failed = 0;
+    for (i = 0; i < batch.count; ++i) {
+        PatchCheckEntry* e = batch.entries + i;
+        int j;
+        for (j = 0; j < totalbaks; ++j) {
+            if (!strncmp(e->filename, bakfiles[j], PATH_MAX)) break;
+        }
+        if (j < totalbaks) {
+            // Listed in the backup table; skipped.
+            e->result = 0;
+            continue;
+        }
+
+        if (is_partition_spec(e->filename)) {
+            e->result = applypatch_check(e->filename, e->num_sha1s, e->sha1s);
+        } else if (e->result == 1) {
+            // If the file is corrupted, it might be because we were
+            // killed in the middle of patching it; see
+            // applypatch_check().
+            if (cache_state == 1) {
+                cache_state = MapFileContents(CACHE_TEMP_SOURCE, &cache,
+                                              RETOUCH_DO_MASK);
+            }
+            if (cache_state == 0 &&
+                FindMatchingPatch(cache.sha1, e->sha1s, e->num_sha1s) >= 0) {
+                e->result = 0;
+            }
+        }
+
+        if (e->result == -ENOENT && totalbaks) {
+            // As for apply_patch_check(): a file removed on a system
+            // with modified files from the backup tool is skipped.
+            sprintf(bakfiles[totalbaks++], "%s", e->filename);
+            e->result = 0;
+        }
+        if (e->result != 0) {
+            fprintf(stderr, "%s: \"%s\" has none of the expected sha1s\n",
+                    name, e->filename);
+            failed_len += strlen(e->filename) + 1;
+            ++failed;
+        }
+    }
+    if (cache_state == 0) FreeFileContents(&cache);
+    fprintf(stderr, "%s: %d of %d files failed\n", name, failed, batch.count);
+
+    char* result = malloc(failed_len + 1);
+    char* p = result;
+    for (i = 0; i < batch.count; ++i) {
+        PatchCheckEntry* e = batch.entries + i;
+        if (e->result != 0) {
+            if (p != result) *p++ = '\n';
+            strcpy(p, e->filename);
+            p += strlen(e->filename);
+        }
+        free(e->sha1s);
+    }
+    *p = '\0';
+    free(batch.entries);
+    free(manifest);
+    return StringValue(result);
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -1246,13 +1975,7 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     free(args);
     buffer[size] = '\0';
 
-    char* line = strtok(buffer, "\n");
-    while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
-    }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    UpdaterPrint((UpdaterInfo*)(state->cookie), "%s", buffer);
 
     return StringValue(buffer);
 }
@@ -1380,6 +2103,37 @@ static char* PrintSha1(uint8_t* digest) {
     return buffer;
 }
 
+// Return the hex string in args[1..argc-1] that matches digest, or ""
+// if none of them do.  Frees args.
+static Value* MatchSha1(const char* name, const uint8_t* digest,
+                        int argc, Value** args) {
+    int i;
+    uint8_t arg_digest[SHA_DIGEST_SIZE];
+    Value* result = NULL;
+    for (i = 1; i < argc; ++i) {
+        if (result != NULL) {
+            FreeValue(args[i]);
+        } else if (args[i]->type != VAL_STRING) {
+            fprintf(stderr, "%s(): arg %d is not a string; skipping",
+                    name, i);
+            FreeValue(args[i]);
+        } else if (ParseSha1(args[i]->data, arg_digest) != 0) {
+            // Warn about bad args and skip them.
+            fprintf(stderr, "%s(): error parsing \"%s\" as sha-1; skipping",
+                    name, args[i]->data);
+            FreeValue(args[i]);
+        } else if (memcmp(digest, arg_digest, SHA_DIGEST_SIZE) == 0) {
+            // Found a match; return the matched string.
+            result = args[i];
+        } else {
+            FreeValue(args[i]);
+        }
+    }
+    free(args);
+    // Didn't match any of the hex strings; return false.
+    return result != NULL ? result : StringValue(strdup(""));
+}
+
 // sha1_check(data)
 //    to return the sha1 of the data (given in the format returned by
 //    read_file).
@@ -1400,6 +2154,11 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     if (args[0]->size < 0) {
         fprintf(stderr, "%s(): no file contents received", name);
+        int i;
+        for (i = 0; i < argc; ++i) {
+            FreeValue(args[i]);
+        }
+        free(args);
         return StringValue(strdup(""));
     }
     uint8_t digest[SHA_DIGEST_SIZE];
@@ -1407,39 +2166,66 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     FreeValue(args[0]);
 
     if (argc == 1) {
+        free(args);
         return StringValue(PrintSha1(digest));
     }
+    return MatchSha1(name, digest, argc, args);
+}
 
-    int i;
-    uint8_t* arg_digest = malloc(SHA_DIGEST_SIZE);
-    for (i = 1; i < argc; ++i) {
-        if (args[i]->type != VAL_STRING) {
-            fprintf(stderr, "%s(): arg %d is not a string; skipping",
-                    name, i);
-        } else if (ParseSha1(args[i]->data, arg_digest) != 0) {
-            // Warn about bad args and skip them.
-            fprintf(stderr, "%s(): error parsing \"%s\" as sha-1; skipping",
-                    name, args[i]->data);
-        } else if (memcmp(digest, arg_digest, SHA_DIGEST_SIZE) == 0) {
-            break;
-        }
-        FreeValue(args[i]);
+// sha1_check_file(filename, [sha1_hex, ...])
+//    like sha1_check(read_file(filename), ...), but reads the file a
+//    chunk at a time instead of holding all of it, so files of any
+//    size can be checked.  Returns "" if the file can't be read.
+//    Partition specs ("MTD:..." or "EMMC:...") aren't accepted; use
+//    sha1_check(read_file(...)) for those.
+Value* Sha1CheckFileFn(const char* name, State* state,
+                       int argc, Expr* argv[]) {
+    if (argc < 1) {
+        return ErrorAbort(state, "%s() expects at least 1 arg", name);
+    }
+
+    Value** args = ReadValueVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
     }
-    if (i >= argc) {
-        // Didn't match any of the hex strings; return false.
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    int result = -1;
+    if (args[0]->type != VAL_STRING) {
+        fprintf(stderr, "%s(): filename is not a string\n", name);
+    } else {
+        result = Sha1File(args[0]->data, digest);
+    }
+    FreeValue(args[0]);
+
+    if (result != 0) {
+        int i;
+        for (i = 1; i < argc; ++i) {
+            FreeValue(args[i]);
+        }
+        free(args);
         return StringValue(strdup(""));
     }
-    // Found a match; free all the remaining arguments and return the
-    // matched one.
-    int j;
-    for (j = i+1; j < argc; ++j) {
-        FreeValue(args[j]);
+    if (argc == 1) {
+        free(args);
+        return StringValue(PrintSha1(digest));
     }
-    return args[i];
+    return MatchSha1(name, digest, argc, args);
+}
+
+static void release_mapped_file(Value* v) {
+    munmap(v->data, v->size);
 }
 
-// Read a local file and return its contents (the Value* returned
-// is actually a FileContents*).
+static const ValueBacking kMappedFile = {
+    NULL, release_mapped_file
+};
+
+// Read a file and return its contents as a blob.  Regular files are
+// mapped rather than copied onto the heap, so their pages can be
+// dropped again under memory pressure; "MTD:"/"EMMC:" partition specs
+// and anything else that can't be mapped are loaded with
+// LoadFileContents().
 Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 1) {
         return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
@@ -1449,35 +2235,281 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     Value* v = malloc(sizeof(Value));
     v->type = VAL_BLOB;
+    v->size = 0;
+    v->data = NULL;
+    v->backing = NULL;
+
+    int fd = -1;
+    struct stat st;
+    if (strncmp(filename, "MTD:", 4) != 0 &&
+        strncmp(filename, "EMMC:", 5) != 0) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            ErrorAbort(state, "%s() loading \"%s\" failed: %s",
+                       name, filename, strerror(errno));
+            goto fail;
+        }
+        if (S_ISREG(st.st_mode)) {
+            if (st.st_size > 0) {
+                void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+                if (data != MAP_FAILED) {
+                    v->size = st.st_size;
+                    v->data = data;
+                    v->backing = &kMappedFile;
+                }
+            }
+            if (v->data != NULL || st.st_size == 0) {
+                close(fd);
+                free(filename);
+                return v;
+            }
+        }
+        close(fd);
+        fd = -1;
+    }
 
     FileContents fc;
     if (LoadFileContents(filename, &fc, RETOUCH_DONT_MASK) != 0) {
         ErrorAbort(state, "%s() loading \"%s\" failed: %s",
                    name, filename, strerror(errno));
-        free(filename);
-        free(v);
-        free(fc.data);
-        return NULL;
+        goto fail;
     }
-
     v->size = fc.size;
     v->data = (char*)fc.data;
-
     free(filename);
     return v;
+
+  fail:
+    if (fd >= 0) close(fd);
+    free(filename);
+    free(v);
+    return NULL;
+}
+
+// Hands the package's new data entry to the transfer list's "new"
+// commands.  The entry is inflated on its own thread, which copies
+// each chunk straight into the buffer the current command is waiting
+// to fill.
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    unsigned char* want;    // where the next bytes go
+    size_t want_len;        // bytes still wanted by the reader
+    bool finished;          // the inflating thread has stopped
+    bool abandoned;         // the reader wants no more
+} NewDataStream;
+
+static bool receive_new_data(const unsigned char* data, int size,
+                             void* cookie) {
+    NewDataStream* nd = (NewDataStream*) cookie;
+    pthread_mutex_lock(&nd->mu);
+    while (size > 0) {
+        while (nd->want_len == 0 && !nd->abandoned) {
+            pthread_cond_wait(&nd->cv, &nd->mu);
+        }
+        if (nd->abandoned) break;
+        size_t n = (size_t)size < nd->want_len ? (size_t)size : nd->want_len;
+        memcpy(nd->want, data, n);
+        nd->want += n;
+        nd->want_len -= n;
+        data += n;
+        size -= n;
+        if (nd->want_len == 0) pthread_cond_broadcast(&nd->cv);
+    }
+    bool keep_going = !nd->abandoned;
+    pthread_mutex_unlock(&nd->mu);
+    return keep_going;
+}
+
+static void* unzip_new_data(void* cookie) {
+    NewDataStream* nd = (NewDataStream*) cookie;
+    mzProcessZipEntryContents(nd->za, nd->entry, receive_new_data, nd);
+    pthread_mutex_lock(&nd->mu);
+    nd->finished = true;
+    pthread_cond_broadcast(&nd->cv);
+    pthread_mutex_unlock(&nd->mu);
+    return NULL;
+}
+
+static int read_new_data(unsigned char* buf, size_t len, void* cookie) {
+    NewDataStream* nd = (NewDataStream*) cookie;
+    pthread_mutex_lock(&nd->mu);
+    nd->want = buf;
+    nd->want_len = len;
+    pthread_cond_broadcast(&nd->cv);
+    while (nd->want_len > 0 && !nd->finished) {
+        pthread_cond_wait(&nd->cv, &nd->mu);
+    }
+    int result = nd->want_len == 0 ? 0 : -1;
+    nd->want_len = 0;
+    pthread_mutex_unlock(&nd->mu);
+    return result;
+}
+
+static void block_image_progress(float fraction, void* cookie) {
+    UpdaterSetProgress((UpdaterInfo*) cookie, fraction);
+}
+
+// block_image_update(block_device, transfer_list, new_data, patch_data)
+//   Apply transfer_list (the contents of a transfer list, as returned
+//   by package_extract_file()) to block_device.  new_data and
+//   patch_data name the package entries holding the data for "new"
+//   commands and the patches for "bsdiff" and "imgdiff" commands.
+//   See blockimg.h for the transfer list format.
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    Value* blockdev_value;
+    Value* transfer_list_value;
+    Value* new_data_value;
+    Value* patch_data_value;
+    if (ReadValueArgs(state, argv, 4, &blockdev_value, &transfer_list_value,
+                      &new_data_value, &patch_data_value) < 0) {
+        return NULL;
+    }
+
+    Value* result = NULL;
+    char* transfer_list = NULL;
+    unsigned char* patch_copy = NULL;
+
+    if (blockdev_value->type != VAL_STRING ||
+        new_data_value->type != VAL_STRING ||
+        patch_data_value->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): block_device, new_data and patch_data "
+                   "must be strings", name);
+        goto done;
+    }
+    if (transfer_list_value->size < 0) {
+        ErrorAbort(state, "%s(): no transfer list contents", name);
+        goto done;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ZipArchive* za = ui->package_zip;
+    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_value->data);
+    if (new_entry == NULL) {
+        ErrorAbort(state, "%s(): no %s in package", name, new_data_value->data);
+        goto done;
+    }
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_value->data);
+    if (patch_entry == NULL) {
+        ErrorAbort(state, "%s(): no %s in package",
+                   name, patch_data_value->data);
+        goto done;
+    }
+
+    BlockImageSources sources;
+    sources.read_new = read_new_data;
+    sources.progress = block_image_progress;
+    sources.progress_cookie = ui;
+    sources.patch_len = mzGetZipEntryUncompLen(patch_entry);
+    // Patches are normally stored, and can be used in place.
+    sources.patch_data = mzGetStoredZipEntryData(za, patch_entry);
+    if (sources.patch_data == NULL) {
+        patch_copy = malloc(sources.patch_len);
+        if (patch_copy == NULL ||
+            !mzExtractZipEntryToBuffer(za, patch_entry, patch_copy)) {
+            ErrorAbort(state, "%s(): failed to extract %s",
+                       name, patch_data_value->data);
+            goto done;
+        }
+        sources.patch_data = patch_copy;
+    }
+
+    transfer_list = malloc(transfer_list_value->size + 1);
+    if (transfer_list == NULL) {
+        ErrorAbort(state, "%s(): out of memory", name);
+        goto done;
+    }
+    memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
+    transfer_list[transfer_list_value->size] = '\0';
+
+    NewDataStream nd;
+    memset(&nd, 0, sizeof(nd));
+    nd.za = za;
+    nd.entry = new_entry;
+    pthread_mutex_init(&nd.mu, NULL);
+    pthread_cond_init(&nd.cv, NULL);
+    sources.new_cookie = &nd;
+
+    pthread_t new_data_thread;
+    if (pthread_create(&new_data_thread, NULL, unzip_new_data, &nd) != 0) {
+        ErrorAbort(state, "%s(): can't start new data thread", name);
+        goto destroy;
+    }
+
+    int status = PerformBlockImageUpdate(blockdev_value->data, transfer_list,
+                                         &sources);
+
+    pthread_mutex_lock(&nd.mu);
+    nd.abandoned = true;
+    pthread_cond_broadcast(&nd.cv);
+    pthread_mutex_unlock(&nd.mu);
+    pthread_join(new_data_thread, NULL);
+
+    if (status != 0) {
+        ErrorAbort(state, "%s(): failed to update %s",
+                   name, blockdev_value->data);
+    } else {
+        result = StringValue(strdup("t"));
+    }
+
+  destroy:
+    pthread_cond_destroy(&nd.cv);
+    pthread_mutex_destroy(&nd.mu);
+  done:
+    free(transfer_list);
+    free(patch_copy);
+    FreeValue(blockdev_value);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_value);
+    FreeValue(patch_data_value);
+    return result;
+}
+
+// range_sha1(block_device, ranges)
+//   Return the sha1 of the blocks of block_device in ranges (a
+//   transfer list rangeset, such as "4,0,100,200,300") as a hex string.
+Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    char* blockdev;
+    char* ranges;
+    if (ReadArgs(state, argv, 2, &blockdev, &ranges) < 0) return NULL;
+
+    Value* result = NULL;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (BlockRangeSha1(blockdev, ranges, digest) != 0) {
+        ErrorAbort(state, "%s(): failed to read %s %s", name, blockdev, ranges);
+    } else {
+        result = StringValue(PrintSha1(digest));
+    }
+    free(blockdev);
+    free(ranges);
+    return result;
 }
 
+// Functions registered with RegisterThreadSafeFunction() may run
+// concurrently inside parallel().  Anything that touches the mtd
+// partition table or the backup file list is not.
 void RegisterInstallFunctions() {
     RegisterFunction("mount", MountFn);
     RegisterFunction("is_mounted", IsMountedFn);
     RegisterFunction("unmount", UnmountFn);
     RegisterFunction("format", FormatFn);
-    RegisterFunction("show_progress", ShowProgressFn);
-    RegisterFunction("set_progress", SetProgressFn);
+    RegisterThreadSafeFunction("show_progress", ShowProgressFn);
+    RegisterThreadSafeFunction("set_progress", SetProgressFn);
     RegisterFunction("delete", DeleteFn);
     RegisterFunction("delete_recursive", DeleteFn);
-    RegisterFunction("package_extract_dir", PackageExtractDirFn);
-    RegisterFunction("package_extract_file", PackageExtractFileFn);
+    RegisterThreadSafeFunction("package_extract_dir", PackageExtractDirFn);
+    RegisterThreadSafeFunction("package_extract_file", PackageExtractFileFn);
     RegisterFunction("symlink", SymlinkFn);
 
     // Maybe, at some future point, we can delete these functions? They have been
@@ -1489,29 +2521,33 @@ void RegisterInstallFunctions() {
     //   set_metadata("filename", "key1", "value1", "key2", "value2", ...)
     // Example:
     //   set_metadata("/system/bin/netcfg", "uid", 0, "gid", 3003, "mode", 02750, "selabel", "u:object_r:system_file:s0", "capabilities", 0x0);
-    RegisterFunction("set_metadata", SetMetadataFn);
+    RegisterThreadSafeFunction("set_metadata", SetMetadataFn);
 
     // Usage:
     //   set_metadata_recursive("dirname", "key1", "value1", "key2", "value2", ...)
     // Example:
     //   set_metadata_recursive("/system", "uid", 0, "gid", 0, "fmode", 0644, "dmode", 0755, "selabel", "u:object_r:system_file:s0", "capabilities", 0x0);
-    RegisterFunction("set_metadata_recursive", SetMetadataFn);
+    RegisterThreadSafeFunction("set_metadata_recursive", SetMetadataFn);
 
-    RegisterFunction("getprop", GetPropFn);
-    RegisterFunction("file_getprop", FileGetPropFn);
+    RegisterThreadSafeFunction("getprop", GetPropFn);
+    RegisterThreadSafeFunction("file_getprop", FileGetPropFn);
     RegisterFunction("write_raw_image", WriteRawImageFn);
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterFunction("apply_patch_check_batch", ApplyPatchCheckBatchFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
     RegisterFunction("read_file", ReadFileFn);
-    RegisterFunction("sha1_check", Sha1CheckFn);
+    RegisterThreadSafeFunction("sha1_check", Sha1CheckFn);
+    RegisterThreadSafeFunction("sha1_check_file", Sha1CheckFileFn);
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+    RegisterThreadSafeFunction("range_sha1", RangeSha1Fn);
     RegisterFunction("rename", RenameFn);
 
     RegisterFunction("wipe_cache", WipeCacheFn);
 
-    RegisterFunction("ui_print", UIPrintFn);
+    RegisterThreadSafeFunction("ui_print", UIPrintFn);
 
     RegisterFunction("run_program", RunProgramFn);
     RegisterFunction("collect_backup_data", CollectBackupDataFn);
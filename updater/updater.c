@@ -14,9 +14,17 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include "edify/expr.h"
 #include "updater.h"
@@ -32,8 +40,138 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Set in the environment to profile the script's function calls.
+#define UPDATER_PROFILE_ENV "UPDATER_PROFILE"
+#define UPDATER_PROFILE_JSON "/tmp/updater_profile.json"
+
 struct selabel_handle *sehandle;
 
+// parallel() can run edify functions on several threads.  Output to
+// recovery goes out one message at a time, and the ui channel only
+// allows one writer.
+static pthread_mutex_t ui_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The command pipe tokenizes on \n, so each line goes out as its own
+// ui_print, then an empty ui_print does the real line break.
+static void print_to_pipe(FILE* cmd_pipe, char* text) {
+    char* save;
+    char* line = strtok_r(text, "\n", &save);
+    while (line) {
+        fprintf(cmd_pipe, "ui_print %s\n", line);
+        line = strtok_r(NULL, "\n", &save);
+    }
+    fprintf(cmd_pipe, "ui_print\n");
+}
+
+void UpdaterPrint(UpdaterInfo* ui, const char* fmt, ...) {
+    char* text;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vasprintf(&text, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+
+    pthread_mutex_lock(&ui_lock);
+    if (ui->ui_channel != NULL) {
+        // The channel only gives up on text if recovery has stopped
+        // draining it; whatever didn't fit still goes out on the pipe.
+        size_t sent = ui_channel_print(ui->ui_channel, text, len);
+        if (sent < (size_t)len) {
+            print_to_pipe(ui->cmd_pipe, text + sent);
+        } else if ((len == 0 || text[len-1] != '\n') &&
+                   ui_channel_print(ui->ui_channel, "\n", 1) != 1) {
+            fprintf(ui->cmd_pipe, "ui_print\n");
+        }
+    } else {
+        print_to_pipe(ui->cmd_pipe, text);
+    }
+    pthread_mutex_unlock(&ui_lock);
+    free(text);
+}
+
+void UpdaterShowProgress(UpdaterInfo* ui, double frac, int sec) {
+    pthread_mutex_lock(&ui_lock);
+    if (ui->ui_channel != NULL) {
+        ui_channel_progress(ui->ui_channel, frac, sec);
+    } else {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    }
+    pthread_mutex_unlock(&ui_lock);
+}
+
+void UpdaterSetProgress(UpdaterInfo* ui, double frac) {
+    pthread_mutex_lock(&ui_lock);
+    if (ui->ui_channel != NULL) {
+        ui_channel_set_progress(ui->ui_channel, frac);
+    } else {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    }
+    pthread_mutex_unlock(&ui_lock);
+}
+
+// Guards UpdaterInfo.written, which parallel() branches add to.
+static pthread_mutex_t written_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void UpdaterNoteWritten(UpdaterInfo* ui, const char* dir) {
+    struct stat st;
+    if (stat(dir, &st) != 0) return;
+
+    pthread_mutex_lock(&written_lock);
+    int i;
+    for (i = 0; i < ui->written_count; ++i) {
+        if (ui->written[i].dev == st.st_dev) break;
+    }
+    if (i == ui->written_count) {
+        WrittenFilesystem* w = realloc(ui->written,
+                                       (i + 1) * sizeof(WrittenFilesystem));
+        if (w != NULL) {
+            ui->written = w;
+            w[i].dev = st.st_dev;
+            w[i].dir = strdup(dir);
+            ui->written_count = w[i].dir != NULL ? i + 1 : i;
+        }
+    }
+    pthread_mutex_unlock(&written_lock);
+}
+
+int UpdaterSyncWritten(UpdaterInfo* ui) {
+    int result = 0;
+    int i;
+    for (i = 0; i < ui->written_count; ++i) {
+        WrittenFilesystem* w = ui->written + i;
+        // If dir is gone or on another device now, the filesystem was
+        // unmounted, and unmounting wrote it back already.
+        int fd = open(w->dir, O_RDONLY | O_DIRECTORY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_dev == w->dev) {
+#ifdef __NR_syncfs
+            int ret = syscall(__NR_syncfs, fd);
+#else
+            sync();
+            int ret = 0;
+#endif
+            if (ret != 0) {
+                fprintf(stderr, "failed to sync %s: %s\n",
+                        w->dir, strerror(errno));
+                result = -1;
+            }
+        }
+        if (fd >= 0) close(fd);
+        free(w->dir);
+    }
+    free(ui->written);
+    ui->written = NULL;
+    ui->written_count = 0;
+    return result;
+}
+
+static long long
+now_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -104,6 +242,7 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    CompileExpr(root);
 
     struct selinux_opt seopts[] = {
       { SELABEL_OPT_PATH, "/file_contexts" }
@@ -122,33 +261,67 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    updater_info.ui_channel = NULL;
+    updater_info.written = NULL;
+    updater_info.written_count = 0;
+
+    const char* channel_fd = getenv(UI_CHANNEL_ENV);
+    if (channel_fd != NULL) {
+        updater_info.ui_channel = ui_channel_attach(atoi(channel_fd));
+        if (updater_info.ui_channel == NULL) {
+            fprintf(stderr, "can't attach ui channel %s; using cmd pipe\n",
+                    channel_fd);
+        }
+    }
+
+    // Profiling is off unless UPDATER_PROFILE_ENV is set, which recovery
+    // does when the recovery.updater_profile property is set.  The table
+    // goes to stderr, which recovery saves in its log; a value starting
+    // with '/' names the JSON file to use instead of the default.
+    const char* profile = getenv(UPDATER_PROFILE_ENV);
+    if (profile != NULL) {
+        SetProfiling(true);
+    }
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
+    long long start = now_msec();
     char* result = Evaluate(&state, root);
+    if (updater_info.ui_channel != NULL) {
+        ui_channel_timing(updater_info.ui_channel, "script",
+                          now_msec() - start);
+    }
+    if (profile != NULL) {
+        SetProfiling(false);
+        WriteProfile(stderr,
+                     profile[0] == '/' ? profile : UPDATER_PROFILE_JSON);
+    }
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            UpdaterPrint(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
-            char* line = strtok(state.errmsg, "\n");
-            while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
-                line = strtok(NULL, "\n");
-            }
-            fprintf(cmd_pipe, "ui_print\n");
+            UpdaterPrint(&updater_info, "%s", state.errmsg);
         }
         free(state.errmsg);
+        // Keep whatever was extracted before the failure, too.
+        UpdaterSyncWritten(&updater_info);
         return 7;
     } else {
         fprintf(stderr, "script result was [%s]\n", result);
         free(result);
     }
 
+    // The script only succeeds once everything it extracted is on disk.
+    if (UpdaterSyncWritten(&updater_info) != 0) {
+        UpdaterPrint(&updater_info, "failed to sync extracted files");
+        return 7;
+    }
+
     if (updater_info.package_zip) {
         mzCloseZipArchive(updater_info.package_zip);
     }
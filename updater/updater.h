@@ -18,17 +18,43 @@
 #define _UPDATER_UPDATER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
 #include "minzip/Zip.h"
+#include "ui_channel.h"
 
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 
+// A filesystem package_extract_file() or package_extract_dir() wrote
+// to, and a directory on it.
+typedef struct {
+    dev_t dev;
+    char* dir;
+} WrittenFilesystem;
+
 typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    UiChannel* ui_channel;  // NULL unless recovery offered one
+    WrittenFilesystem* written;
+    int written_count;
 } UpdaterInfo;
 
+// Messages for recovery's screen.  These go through the shared-memory
+// channel when recovery set one up, and over cmd_pipe otherwise.
+void UpdaterPrint(UpdaterInfo* ui, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void UpdaterShowProgress(UpdaterInfo* ui, double frac, int sec);
+void UpdaterSetProgress(UpdaterInfo* ui, double frac);
+
+// Extracted files aren't synced as they are written.  Note the
+// filesystem holding dir instead; when the script ends,
+// UpdaterSyncWritten() syncs each noted filesystem once and returns -1
+// if any of them failed.
+void UpdaterNoteWritten(UpdaterInfo* ui, const char* dir);
+int UpdaterSyncWritten(UpdaterInfo* ui);
+
 extern struct selabel_handle *sehandle;
 
 #endif
@@ -24,24 +24,179 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Packages are hashed in chunks of this size; it is also the read size
+// when the package can't be mapped.
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+static void
+update_progress(size_t so_far, size_t total, double* frac) {
+    double f = so_far / (double)total;
+    if (f > *frac + 0.02 || so_far == total) {
+        ui_set_progress(f);
+        *frac = f;
+    }
+}
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+// Reading a mapped package raises SIGBUS instead of returning an error
+// if the file is truncated underneath us or the storage fails, so the
+// hashing threads each register a place to jump back to while they
+// touch the mapping.  Slot 0 is the calling thread, slot 1 the SHA-1
+// thread.
+typedef struct {
+    pthread_t thread;
+    sigjmp_buf env;
+} FaultGuard;
+
+static FaultGuard* volatile fault_guards[2];
+
+static void
+hash_sigbus(int sig, siginfo_t* info, void* context) {
+    pthread_t self = pthread_self();
+    int i;
+    for (i = 0; i < 2; ++i) {
+        FaultGuard* guard = fault_guards[i];
+        if (guard != NULL && pthread_equal(guard->thread, self)) {
+            siglongjmp(guard->env, 1);
+        }
+    }
+    // Not a fault in the package mapping: let it kill us as usual once
+    // the instruction is retried.
+    signal(SIGBUS, SIG_DFL);
+}
 
-int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    SHA_CTX* ctx;
+    volatile bool faulted;
+} Sha1Job;
+
+static void*
+sha1_thread(void* cookie) {
+    Sha1Job* job = (Sha1Job*)cookie;
+    FaultGuard guard;
+    guard.thread = pthread_self();
+    if (sigsetjmp(guard.env, 1) != 0) {
+        fault_guards[1] = NULL;
+        job->faulted = true;
+        return NULL;
+    }
+    fault_guards[1] = &guard;
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
+    size_t so_far = 0;
+    while (so_far < job->len) {
+        size_t size = job->len - so_far;
+        if (size > HASH_CHUNK_SIZE) size = HASH_CHUNK_SIZE;
+        SHA_update(job->ctx, job->data + so_far, size);
+        so_far += size;
+    }
+    fault_guards[1] = NULL;
+    return NULL;
+}
+
+// Hash "len" mapped bytes into whichever contexts are non-NULL.  When
+// both digests are wanted, SHA-1 runs on a second thread while this one
+// does SHA-256 (the slower of the two) and drives the progress bar.
+// Returns false if the mapping couldn't be read.
+static bool
+hash_mapped(const unsigned char* data, size_t len,
+            SHA_CTX* sha1_ctx, SHA256_CTX* sha256_ctx) {
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = hash_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &old_sa);
+
+    pthread_t thread;
+    bool threaded = false;
+    Sha1Job job;
+    job.faulted = false;
+
+    if (sha1_ctx != NULL && sha256_ctx != NULL) {
+        job.data = data;
+        job.len = len;
+        job.ctx = sha1_ctx;
+        threaded = pthread_create(&thread, NULL, sha1_thread, &job) == 0;
+        if (threaded) sha1_ctx = NULL;
+    }
+
+    bool faulted = false;
+    FaultGuard guard;
+    guard.thread = pthread_self();
+    if (sigsetjmp(guard.env, 1) != 0) {
+        faulted = true;
+    } else {
+        fault_guards[0] = &guard;
+        double frac = -1.0;
+        size_t so_far = 0;
+        while (so_far < len) {
+            size_t size = len - so_far;
+            if (size > HASH_CHUNK_SIZE) size = HASH_CHUNK_SIZE;
+            if (sha1_ctx) SHA_update(sha1_ctx, data + so_far, size);
+            if (sha256_ctx) SHA256_update(sha256_ctx, data + so_far, size);
+            so_far += size;
+            update_progress(so_far, len, &frac);
+        }
+    }
+    fault_guards[0] = NULL;
+
+    if (threaded) {
+        pthread_join(thread, NULL);
+        if (job.faulted) faulted = true;
     }
+    sigaction(SIGBUS, &old_sa, NULL);
+    return !faulted;
+}
+
+// Fallback for when the package can't be mapped: large sequential reads
+// with read-ahead hinted to the kernel.
+static bool
+hash_read(int fd, size_t len, SHA_CTX* sha1_ctx, SHA256_CTX* sha256_ctx) {
+    unsigned char* buffer = (unsigned char*)malloc(HASH_CHUNK_SIZE);
+    if (buffer == NULL) {
+        LOGE("failed to alloc memory for hash buffer\n");
+        return false;
+    }
+    posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
 
+    double frac = -1.0;
+    size_t so_far = 0;
+    while (so_far < len) {
+        size_t size = len - so_far;
+        if (size > HASH_CHUNK_SIZE) size = HASH_CHUNK_SIZE;
+        ssize_t n = TEMP_FAILURE_RETRY(pread(fd, buffer, size, so_far));
+        if (n <= 0) {
+            free(buffer);
+            return false;
+        }
+        if (sha1_ctx) SHA_update(sha1_ctx, buffer, n);
+        if (sha256_ctx) SHA256_update(sha256_ctx, buffer, n);
+        so_far += n;
+        update_progress(so_far, len, &frac);
+    }
+    free(buffer);
+    return true;
+}
+
+// Check the whole-file signature of the already-open package "f".
+// Doesn't close "f".  If "mapped" is non-NULL it is an existing mapping
+// of the first "mapped_len" bytes of the file, which is hashed instead
+// of mapping the file again.
+static int
+verify_stream(FILE* f, const char* path,
+              const Certificate* pKeys, unsigned int numKeys,
+              const unsigned char* mapped, size_t mapped_len) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -55,20 +210,17 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
 
     if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
         LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
     unsigned char footer[FOOTER_SIZE];
     if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
         LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -80,7 +232,6 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -92,7 +243,6 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
 
     if (fseek(f, -eocd_size, SEEK_END) != 0) {
         LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -105,12 +255,10 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     unsigned char* eocd = malloc(eocd_size);
     if (eocd == NULL) {
         LOGE("malloc for EOCD record failed\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
     if (fread(eocd, 1, eocd_size, f) != eocd_size) {
         LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -119,7 +267,6 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -132,13 +279,10 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
-
     bool need_sha1 = false;
     bool need_sha256 = false;
     for (i = 0; i < numKeys; ++i) {
@@ -152,35 +296,38 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     SHA256_CTX sha256_ctx;
     SHA_init(&sha1_ctx);
     SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
 
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-        unsigned int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
+    int fd = fileno(f);
+    void* map = NULL;
+    if (mapped == NULL || mapped_len < signed_len) {
+        mapped = NULL;
+        map = mmap(NULL, signed_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, signed_len, MADV_SEQUENTIAL);
+            mapped = (const unsigned char*)map;
+        } else {
+            LOGI("can't map %s (%s); reading instead\n", path, strerror(errno));
+        }
+    }
+    if (mapped != NULL) {
+        bool ok = hash_mapped(mapped, signed_len,
+                              need_sha1 ? &sha1_ctx : NULL,
+                              need_sha256 ? &sha256_ctx : NULL);
+        if (map != NULL) munmap(map, signed_len);
+        if (!ok) {
+            LOGE("failed to read data from %s (bus error)\n", path);
+            free(eocd);
             return VERIFY_FAILURE;
         }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
+    } else {
+        if (!hash_read(fd, signed_len,
+                       need_sha1 ? &sha1_ctx : NULL,
+                       need_sha256 ? &sha256_ctx : NULL)) {
+            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
+            free(eocd);
+            return VERIFY_FAILURE;
         }
     }
-    fclose(f);
-    free(buffer);
 
     const uint8_t* sha1 = SHA_final(&sha1_ctx);
     const uint8_t* sha256 = SHA256_final(&sha256_ctx);
@@ -209,6 +356,155 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     return VERIFY_FAILURE;
 }
 
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the path to the zip.  Verify it matches one of the given public
+// keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int ret = verify_stream(f, path, pKeys, numKeys, NULL, 0);
+    fclose(f);
+    return ret;
+}
+
+// Packages that verified successfully, identified by the file they were
+// read from and the key set they were checked against.  If any of the
+// stat fields has changed, the package may have been rewritten and has
+// to be hashed again.
+typedef struct {
+    bool valid;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint8_t keys_digest[SHA_DIGEST_SIZE];
+} VerifiedPackage;
+
+#define VERIFIED_CACHE_SIZE 4
+
+static VerifiedPackage verified_cache[VERIFIED_CACHE_SIZE];
+static int verified_cache_next = 0;
+
+static void
+digest_keys(const Certificate* pKeys, unsigned int numKeys, uint8_t* digest) {
+    SHA_CTX ctx;
+    unsigned int i;
+    SHA_init(&ctx);
+    for (i = 0; i < numKeys; ++i) {
+        SHA_update(&ctx, &pKeys[i].hash_len, sizeof(pKeys[i].hash_len));
+        SHA_update(&ctx, pKeys[i].public_key, sizeof(RSAPublicKey));
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
+
+static bool
+same_time(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Timestamps are compared to the nanosecond: a package sideloaded again
+// within the same second can land on a reused tmpfs inode with the
+// same size.
+static bool
+same_file(const VerifiedPackage* v, const struct stat* st) {
+    return v->dev == st->st_dev && v->ino == st->st_ino &&
+           v->size == st->st_size && same_time(&v->mtime, &st->st_mtim) &&
+           same_time(&v->ctime, &st->st_ctim);
+}
+
+// Shared body of verify_file_cached() and verify_mapped_file().
+static int
+verify_stream_cached(FILE* f, const char* path,
+                     const Certificate* pKeys, unsigned int numKeys,
+                     const unsigned char* mapped, size_t mapped_len) {
+    struct stat before;
+    if (fstat(fileno(f), &before) != 0) {
+        LOGE("failed to stat %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    uint8_t keys_digest[SHA_DIGEST_SIZE];
+    digest_keys(pKeys, numKeys, keys_digest);
+
+    int i;
+    for (i = 0; i < VERIFIED_CACHE_SIZE; ++i) {
+        const VerifiedPackage* v = verified_cache + i;
+        if (v->valid && same_file(v, &before) &&
+            memcmp(v->keys_digest, keys_digest, SHA_DIGEST_SIZE) == 0) {
+            LOGI("%s is unchanged since it was verified; skipping\n", path);
+            ui_set_progress(1.0);
+            return VERIFY_SUCCESS;
+        }
+    }
+
+    int ret = verify_stream(f, path, pKeys, numKeys, mapped, mapped_len);
+
+    // Only remember the result if the file didn't change under us while
+    // it was being hashed.
+    struct stat after;
+    if (ret == VERIFY_SUCCESS && fstat(fileno(f), &after) == 0) {
+        VerifiedPackage* v = verified_cache + verified_cache_next;
+        v->valid = false;
+        v->dev = before.st_dev;
+        v->ino = before.st_ino;
+        v->size = before.st_size;
+        v->mtime = before.st_mtim;
+        v->ctime = before.st_ctim;
+        if (same_file(v, &after)) {
+            memcpy(v->keys_digest, keys_digest, SHA_DIGEST_SIZE);
+            v->valid = true;
+            verified_cache_next = (verified_cache_next + 1) % VERIFIED_CACHE_SIZE;
+        } else {
+            LOGE("%s changed while it was being verified\n", path);
+            ret = VERIFY_FAILURE;
+        }
+    }
+    return ret;
+}
+
+int verify_file_cached(const char* path, const Certificate* pKeys,
+                       unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int ret = verify_stream_cached(f, path, pKeys, numKeys, NULL, 0);
+    fclose(f);
+    return ret;
+}
+
+int verify_mapped_file(const char* path, int fd,
+                       const unsigned char* addr, size_t length,
+                       const Certificate* pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    // The footer and EOCD are read through a private stdio stream; only
+    // pread() is used on the original fd, so sharing its offset is fine.
+    int dupfd = dup(fd);
+    FILE* f = dupfd < 0 ? NULL : fdopen(dupfd, "rb");
+    if (f == NULL) {
+        LOGE("failed to reopen %s (%s)\n", path, strerror(errno));
+        if (dupfd >= 0) close(dupfd);
+        return VERIFY_FAILURE;
+    }
+    int ret = verify_stream_cached(f, path, pKeys, numKeys, addr, length);
+    fclose(f);
+    return ret;
+}
+
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
 // as a C source literal, eg:
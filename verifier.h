@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+
 #include "mincrypt/rsa.h"
 
 typedef struct Certificate {
@@ -29,6 +31,21 @@ typedef struct Certificate {
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), but remembers packages that verified successfully.
+ * Verifying the same unchanged file (same device, inode, size, mtime and
+ * ctime) against the same keys again succeeds without rehashing it.
+ */
+int verify_file_cached(const char* path, const Certificate *pKeys, unsigned int numKeys);
+
+/* Like verify_file_cached(), but for a package that is already open and
+ * mapped in full (e.g. by mzOpenZipArchive()).  The package is hashed
+ * from that mapping instead of being read again.  Safe to call on one
+ * thread while others read the package with pread().
+ */
+int verify_mapped_file(const char* path, int fd,
+                       const unsigned char* addr, size_t length,
+                       const Certificate *pKeys, unsigned int numKeys);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
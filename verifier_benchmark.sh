@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Times recovery's package signature verifier on packages scaled up to
+# realistic OTA sizes.  Run in a client where you have done envsetup,
+# lunch, etc., with verifier_test built.
+#
+# Each package is testdata/otasigned.zip's contents plus a block of
+# random data, re-signed with the test key, so it takes the same path
+# through verify_file() as a real package.  The -sha256 run gets its own
+# copy signed with testkey_sha256.x509.pem (the same key, with a SHA-256
+# certificate), which makes signapk use SHA-256 for the signature.
+#
+# usage: verifier_benchmark.sh [size-in-MB ...]   (default: 64 256 1024)
+
+DATA_DIR=$ANDROID_BUILD_TOP/bootable/recovery/testdata
+SIGNAPK=$ANDROID_HOST_OUT/framework/signapk.jar
+WORK_DIR=/data/local/tmp
+HOST_DIR=$(mktemp -d)
+
+ADB="adb -d "
+
+SIZES="$@"
+[ -z "$SIZES" ] && SIZES="64 256 1024"
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+cleanup() {
+  run_command rm $WORK_DIR/verifier_test
+  run_command rm $WORK_DIR/package.zip
+  rm -rf $HOST_DIR
+}
+
+make_package() {
+  local mb=$1
+  local cert=$2
+  local out=$3
+  mkdir -p $HOST_DIR/pkg
+  (cd $HOST_DIR/pkg && unzip -qo $DATA_DIR/otasigned.zip -x 'META-INF/*')
+  dd if=/dev/urandom of=$HOST_DIR/pkg/payload.bin bs=1048576 count=$mb 2>/dev/null
+  rm -f $HOST_DIR/unsigned.zip
+  (cd $HOST_DIR/pkg && zip -qr0 $HOST_DIR/unsigned.zip .)
+  java -jar $SIGNAPK -w $DATA_DIR/$cert $DATA_DIR/testkey.pk8 \
+       $HOST_DIR/unsigned.zip $out || exit 1
+  rm -rf $HOST_DIR/pkg
+}
+
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/verifier_test \
+          $WORK_DIR/verifier_test
+
+for mb in $SIZES; do
+  for args in "" "-sha256"; do
+    if [ -z "$args" ]; then
+      make_package $mb testkey.x509.pem $HOST_DIR/package.zip
+    else
+      make_package $mb testkey_sha256.x509.pem $HOST_DIR/package.zip
+    fi
+    $ADB push $HOST_DIR/package.zip $WORK_DIR/package.zip
+
+    # Drop the page cache so every run reads the package from storage.
+    run_command "sync; echo 3 > /proc/sys/vm/drop_caches"
+    start=$(date +%s.%N)
+    run_command $WORK_DIR/verifier_test $args $WORK_DIR/package.zip > /dev/null
+    status=$?
+    end=$(date +%s.%N)
+    printf "%5d MB %-8s %6.2fs %s\n" $mb "${args:--sha1}" \
+           $(echo "$end - $start" | bc) \
+           $([ $status == 0 ] && echo VERIFIED || echo "NOT VERIFIED")
+  done
+done
+
+cleanup